@@ -0,0 +1,169 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Smoke test and benchmark of the libjson build profiles
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+// Built once against the default libjson and once against the JSON_FAST
+// profile. Each build first checks that client commands round-trip to the
+// same text and that malformed input is dispatched as expected, then times
+// parsing the commands and writing a listener update.
+//
+// Build and run both with `scons bench && ./bench/json_bench_default && ./bench/json_bench_fast`.
+// It exits non-zero if a check fails.
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "../libjson/libjson.h"
+
+#ifdef JSON_FAST
+const char* const PROFILE = "fast";
+#else
+const char* const PROFILE = "default";
+#endif
+
+/// Client commands, written the way libjson writes them back
+const char* const COMMANDS[] = {
+	"{\"_cmd\":\"selectDevice\",\"id\":\"com.nonolithlabs.cee*1234\"}",
+	"{\"_cmd\":\"configure\",\"id\":2,\"mode\":0,\"sampleTime\":4e-05,\"samples\":100000,\"continuous\":false,\"raw\":false}",
+	"{\"_cmd\":\"listen\",\"id\":3,\"streams\":[{\"channel\":\"a\",\"stream\":\"v\"},{\"channel\":\"a\",\"stream\":\"i\"}],\"decimateFactor\":10,\"start\":-1,\"count\":-1}",
+	"{\"_cmd\":\"set\",\"id\":4,\"channel\":\"a\",\"mode\":1,\"source\":\"sine\",\"offset\":2.5,\"amplitude\":2,\"period\":1000,\"phase\":0,\"relPhase\":false}",
+	"{\"_cmd\":\"set\",\"channel\":\"b\",\"mode\":2,\"source\":\"arb\",\"values\":[{\"t\":0,\"v\":0},{\"t\":100,\"v\":1},{\"t\":200,\"v\":-1}],\"repeat\":-1}",
+	"{\"_cmd\":\"startCapture\",\"name\":\"tab\\there \\\"quoted\\\"\"}",
+};
+
+struct DispatchCase{
+	const char* text;
+	const char* cmd; // 0 if the message is rejected
+};
+
+/// How malformed input fares in the server's dispatch, parse() then
+/// at("_cmd"). libjson lets some of it through; this pins down the current
+/// behaviour so the profiles can't drift apart unnoticed. Only named lookups
+/// are used, as in the handlers: indexing the children of a node with a
+/// trailing comma crashes in both profiles.
+const DispatchCase DISPATCH[] = {
+	{"{\"_cmd\":\"set\",\"channel\":[}", "set"},
+	{"{\"_cmd\":\"listen\",\"id\":3,}", "listen"},
+	{"{\"_cmd\" \"startCapture\"}", 0},
+	{"{\"_cmd\":\"set\"", 0},
+	{"{\"_cmd\":\"set\"} x", 0},
+	{"[\"_cmd\",\"set\"]", 0},
+	{"nul", 0},
+	{"", 0},
+#ifdef JSON_FAST
+	{"{/*note*/\"_cmd\":\"set\"}", 0},
+#else
+	{"{/*note*/\"_cmd\":\"set\"}", "set"},
+#endif
+};
+
+const unsigned NCOMMANDS = sizeof(COMMANDS)/sizeof(COMMANDS[0]);
+const unsigned NDISPATCH = sizeof(DISPATCH)/sizeof(DISPATCH[0]);
+
+/// Streams and points per stream in the timed listener update
+const unsigned UPDATE_STREAMS = 2;
+const unsigned UPDATE_POINTS = 100;
+
+static double elapsed(boost::posix_time::ptime since){
+	using namespace boost::posix_time;
+	return (microsec_clock::universal_time() - since).total_microseconds() / 1e6;
+}
+
+static JSONNode listenerUpdate(unsigned idx){
+	JSONNode n(JSON_NODE);
+	n.push_back(JSONNode("id", 3));
+	n.push_back(JSONNode("idx", idx));
+
+	JSONNode data(JSON_ARRAY);
+	data.set_name("data");
+	for (unsigned s=0; s<UPDATE_STREAMS; s++){
+		JSONNode a(JSON_ARRAY);
+		for (unsigned i=0; i<UPDATE_POINTS; i++){
+			a.push_back(JSONNode("", (float) ((idx + i*7 + s*13) % 4096) / 819.2f));
+		}
+		data.push_back(a);
+	}
+	n.push_back(data);
+	n.push_back(JSONNode("_action", "update"));
+	return n;
+}
+
+static bool check(){
+	bool ok = true;
+
+	for (unsigned k=0; k<NCOMMANDS; k++){
+		try{
+			// parse() is lazy, and write() echoes text that was never parsed
+			JSONNode n = libjson::parse(COMMANDS[k]);
+			n.preparse();
+			std::string out = n.write();
+			if (out != COMMANDS[k]){
+				std::cerr << "FAIL round trip\n  in:  " << COMMANDS[k] << "\n  out: " << out << std::endl;
+				ok = false;
+			}
+		}catch(std::exception& e){
+			std::cerr << "FAIL parse: " << e.what() << "\n  in:  " << COMMANDS[k] << std::endl;
+			ok = false;
+		}
+	}
+
+	for (unsigned k=0; k<NDISPATCH; k++){
+		const DispatchCase& c = DISPATCH[k];
+		std::string cmd;
+		bool rejected = false;
+		try{
+			cmd = libjson::parse(c.text).at("_cmd").as_string();
+		}catch(std::exception&){
+			rejected = true;
+		}
+		if (rejected != !c.cmd || (c.cmd && cmd != c.cmd)){
+			std::cerr << "FAIL dispatch of " << c.text << ": expected " << (c.cmd ? c.cmd : "rejection")
+				<< ", got " << (rejected ? "rejection" : cmd) << std::endl;
+			ok = false;
+		}
+	}
+
+	JSONNode u = libjson::parse(listenerUpdate(0).write());
+	if (u.at("data").size() != UPDATE_STREAMS || u.at("data")[0].size() != UPDATE_POINTS){
+		std::cerr << "FAIL listener update did not round trip" << std::endl;
+		ok = false;
+	}
+
+	return ok;
+}
+
+int main(){
+	using namespace boost::posix_time;
+
+	if (!check()){
+		std::cerr << PROFILE << ": checks failed" << std::endl;
+		return 1;
+	}
+
+	const unsigned rounds = 100000;
+	unsigned total = 0;
+
+	ptime start = microsec_clock::universal_time();
+	for (unsigned r=0; r<rounds; r++){
+		for (unsigned k=0; k<NCOMMANDS; k++){
+			total += libjson::parse(COMMANDS[k]).size();
+		}
+	}
+	double parse = elapsed(start);
+
+	start = microsec_clock::universal_time();
+	for (unsigned r=0; r<rounds/10; r++){
+		total += listenerUpdate(r).write().size();
+	}
+	double write = elapsed(start);
+
+	std::cout << PROFILE << ": checks passed, parse command " << parse/(rounds*NCOMMANDS)*1e9 << " ns, "
+		<< "build and write update " << write/(rounds/10)*1e9 << " ns   (" << total << ")" << std::endl;
+	return 0;
+}
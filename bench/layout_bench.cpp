@@ -0,0 +1,164 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Benchmark of the separate and interleaved stream layouts
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+// Stores a CEE-like capture (2 channels of 2 streams) into the ring the way
+// the ingest thread does, then reads it back the way WSStreamListener does,
+// for each layout and storage format. The addressing is a copy of
+// Stream::offset and the loops follow StreamingDevice::putCode and resample,
+// so keep them in step with streaming_device.hpp.
+//
+// Build and run with `scons bench && ./bench/layout_bench [samples]`, or:
+//   g++ -O3 -o layout_bench bench/layout_bench.cpp
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <sstream>
+#include <stdint.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+const unsigned LAYOUT_BLOCK_SHIFT = 4;
+const unsigned LAYOUT_BLOCK_SAMPLES = 1 << LAYOUT_BLOCK_SHIFT;
+const int16_t STREAM_CODE_ZERO = INT16_MIN;
+
+const unsigned CHANNELS = 2;
+const unsigned STREAMS = 2;
+
+/// Decimation factors a client typically listens with
+const unsigned DECIMATE[] = {1, 10, 100};
+
+template<typename T>
+struct BenchStream{
+	T* data;
+	unsigned blockShift, blockMask, blockStride;
+
+	inline unsigned offset(unsigned i){
+		return (i >> blockShift) * blockStride + (i & blockMask);
+	}
+};
+
+template<typename T>
+struct BenchChannel{
+	BenchStream<T> streams[STREAMS];
+	std::vector<T*> buffers;
+
+	BenchChannel(unsigned samples, bool interleaved){
+		if (interleaved){
+			unsigned blocks = (samples + LAYOUT_BLOCK_SAMPLES - 1) / LAYOUT_BLOCK_SAMPLES;
+			T* buffer = alloc(blocks * STREAMS * LAYOUT_BLOCK_SAMPLES);
+			for (unsigned j=0; j<STREAMS; j++){
+				BenchStream<T> s = {buffer + j*LAYOUT_BLOCK_SAMPLES, LAYOUT_BLOCK_SHIFT,
+					LAYOUT_BLOCK_SAMPLES-1, STREAMS*LAYOUT_BLOCK_SAMPLES};
+				streams[j] = s;
+			}
+		}else{
+			for (unsigned j=0; j<STREAMS; j++){
+				BenchStream<T> s = {alloc(samples), 0, 0, 1};
+				streams[j] = s;
+			}
+		}
+	}
+
+	~BenchChannel(){
+		for (unsigned i=0; i<buffers.size(); i++) free(buffers[i]);
+	}
+
+	T* alloc(size_t n){
+		void* p = 0;
+		if (posix_memalign(&p, 64, n*sizeof(T))) abort();
+		buffers.push_back((T*) p);
+		return (T*) p;
+	}
+};
+
+inline float value(float v){ return v; }
+inline float value(int16_t c){ return (c == STREAM_CODE_ZERO) ? 0 : c * (1.0f/2048); }
+
+template<typename T> T sample(unsigned i, unsigned j);
+template<> float sample<float>(unsigned i, unsigned j){ return (i*7 + j*13) % 4096 / 2048.0f; }
+template<> int16_t sample<int16_t>(unsigned i, unsigned j){ return (i*7 + j*13) % 4096 - 2048; }
+
+static double elapsed(boost::posix_time::ptime since){
+	using namespace boost::posix_time;
+	return (microsec_clock::universal_time() - since).total_microseconds() / 1e6;
+}
+
+/// Millions of stream samples per second for each phase
+template<typename T>
+void run(const char* name, unsigned samples, bool interleaved){
+	using namespace boost::posix_time;
+	std::vector<BenchChannel<T>*> channels;
+	for (unsigned c=0; c<CHANNELS; c++) channels.push_back(new BenchChannel<T>(samples, interleaved));
+
+	// Ingest: each sample of the transfer is stored to every stream
+	ptime start = microsec_clock::universal_time();
+	for (unsigned i=0; i<samples; i++){
+		for (unsigned c=0; c<CHANNELS; c++){
+			for (unsigned j=0; j<STREAMS; j++){
+				BenchStream<T>& s = channels[c]->streams[j];
+				s.data[s.offset(i)] = sample<T>(i, j);
+			}
+		}
+	}
+	double ingest = elapsed(start);
+
+	std::cout << std::setw(8) << name << std::setw(12) << (interleaved ? "interleaved" : "separate")
+		<< std::setw(10) << std::fixed << std::setprecision(1) << samples*CHANNELS*STREAMS/ingest/1e6;
+
+	// Listener: each stream's chunks are averaged in turn
+	double check = 0;
+	for (unsigned d=0; d<sizeof(DECIMATE)/sizeof(DECIMATE[0]); d++){
+		unsigned decimate = DECIMATE[d];
+		unsigned nchunks = samples / decimate;
+		start = microsec_clock::universal_time();
+		for (unsigned c=0; c<CHANNELS; c++){
+			for (unsigned j=0; j<STREAMS; j++){
+				BenchStream<T>& s = channels[c]->streams[j];
+				for (unsigned chunk=0; chunk<nchunks; chunk++){
+					float total = 0;
+					for (unsigned i=0; i<decimate; i++){
+						total += value(s.data[s.offset(chunk*decimate + i)]);
+					}
+					check += total/decimate;
+				}
+			}
+		}
+		double listen = elapsed(start);
+		std::cout << std::setw(12) << nchunks*decimate*CHANNELS*STREAMS/listen/1e6;
+	}
+	std::cout << "   (" << check << ")" << std::endl;
+
+	for (unsigned c=0; c<CHANNELS; c++) delete channels[c];
+}
+
+int main(int argc, char** argv){
+	unsigned samples = (argc > 1) ? strtoul(argv[1], 0, 10) : 10*1000*1000;
+	samples = samples / LAYOUT_BLOCK_SAMPLES * LAYOUT_BLOCK_SAMPLES;
+	if (!samples){
+		std::cerr << "usage: layout_bench [samples]" << std::endl;
+		return 1;
+	}
+
+	std::cout << samples << " samples, " << CHANNELS << "x" << STREAMS << " streams, Msamples/s" << std::endl;
+	std::cout << std::setw(8) << "storage" << std::setw(12) << "layout" << std::setw(10) << "ingest";
+	for (unsigned d=0; d<sizeof(DECIMATE)/sizeof(DECIMATE[0]); d++){
+		std::ostringstream col;
+		col << "listen/" << DECIMATE[d];
+		std::cout << std::setw(12) << col.str();
+	}
+	std::cout << std::endl;
+
+	for (int round=0; round<2; round++){
+		run<float>("float", samples, false);
+		run<float>("float", samples, true);
+		run<int16_t>("compact", samples, false);
+		run<int16_t>("compact", samples, true);
+	}
+	return 0;
+}
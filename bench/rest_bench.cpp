@@ -0,0 +1,190 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Requests/sec of a client polling the REST API
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+// Polls one REST resource of a running server the way a script does, and
+// reports requests per second and connections opened for each client style:
+//   close      a new connection for every request
+//   keepalive  one request at a time, reusing the connection while the
+//              server keeps it open
+//   pipelined  PIPELINE_DEPTH requests written back to back per round trip
+// When the server closes the connection after each response, the last two
+// fall back to reconnecting, and the connection count shows it.
+//
+// Build and run with `scons bench && ./bench/rest_bench [host:port] [path] [seconds]`.
+// The default path, the device list, needs no hardware; pass a device's
+// output resource, e.g. /rest/v1/devices/<id>/a/output, to poll that.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using std::string;
+using boost::asio::ip::tcp;
+
+const unsigned PIPELINE_DEPTH = 8;
+
+struct BenchError: public std::runtime_error{
+	BenchError(const string& s): std::runtime_error(s){}
+};
+
+static double elapsed(boost::posix_time::ptime since){
+	using namespace boost::posix_time;
+	return (microsec_clock::universal_time() - since).total_microseconds() / 1e6;
+}
+
+class Poller{
+	public:
+		Poller(const string& host, const string& port, const string& path):
+			connections(0), host(host), path(path){
+			tcp::resolver resolver(io);
+			endpoint = *resolver.resolve(tcp::resolver::query(host, port));
+		}
+
+		unsigned connections;
+
+		/// Send `depth` requests and read their responses. Returns how many
+		/// were answered before the server closed the connection.
+		unsigned round(unsigned depth, bool keepAlive){
+			if (!sock){
+				sock.reset(new tcp::socket(io));
+				sock->connect(endpoint);
+				sock->set_option(tcp::no_delay(true));
+				buf.consume(buf.size());
+				connections++;
+			}
+
+			std::ostringstream req;
+			for (unsigned i=0; i<depth; i++){
+				req << "GET " << path << " HTTP/1.1\r\n"
+				    << "Host: " << host << "\r\n"
+				    << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+			}
+			boost::asio::write(*sock, boost::asio::buffer(req.str()));
+
+			unsigned answered = 0;
+			bool reusable = keepAlive;
+			while (answered < depth && readResponse(reusable)){
+				answered++;
+				if (!reusable) break;
+			}
+			if (!reusable || answered < depth) sock.reset();
+			return answered;
+		}
+
+	private:
+		boost::asio::io_service io;
+		tcp::endpoint endpoint;
+		string host, path;
+		boost::scoped_ptr<tcp::socket> sock;
+		boost::asio::streambuf buf;
+
+		/// Read one response into buf and consume it. Returns false if the
+		/// connection closed before a response started. Clears `reusable` if
+		/// the server will close the connection after it.
+		bool readResponse(bool& reusable){
+			boost::system::error_code ec;
+			size_t headerLen = boost::asio::read_until(*sock, buf, "\r\n\r\n", ec);
+			if (ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset){
+				reusable = false;
+				return false;
+			}else if (ec){
+				throw boost::system::system_error(ec);
+			}
+
+			string header(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + headerLen);
+			buf.consume(headerLen);
+
+			std::istringstream h(header);
+			string version, line;
+			unsigned status = 0;
+			h >> version >> status;
+			std::getline(h, line);
+			if (status != 200){
+				throw BenchError("server responded " + header.substr(0, header.find('\r')));
+			}
+			if (version != "HTTP/1.1") reusable = false;
+
+			long length = -1;
+			while (std::getline(h, line) && line != "\r"){
+				size_t colon = line.find(':');
+				if (colon == string::npos) continue;
+				string name = line.substr(0, colon);
+				string value = line.substr(colon + 1);
+				std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+				std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+				if (name == "content-length"){
+					length = strtol(value.c_str(), 0, 10);
+				}else if (name == "connection" && value.find("close") != string::npos){
+					reusable = false;
+				}else if (name == "transfer-encoding" && value.find("chunked") != string::npos){
+					throw BenchError("chunked responses are not supported");
+				}
+			}
+
+			if (length < 0){
+				// Delimited by the end of the connection
+				boost::asio::read(*sock, buf, boost::asio::transfer_all(), ec);
+				if (ec && ec != boost::asio::error::eof) throw boost::system::system_error(ec);
+				buf.consume(buf.size());
+				reusable = false;
+			}else{
+				if (buf.size() < (size_t) length){
+					boost::asio::read(*sock, buf, boost::asio::transfer_at_least(length - buf.size()));
+				}
+				buf.consume(length);
+			}
+			return true;
+		}
+};
+
+static void run(Poller& poller, const char* name, unsigned depth, bool keepAlive, double seconds){
+	unsigned requests = 0;
+	poller.connections = 0;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	double t;
+	while ((t = elapsed(start)) < seconds){
+		requests += poller.round(depth, keepAlive);
+	}
+
+	std::cout << std::setw(10) << name
+		<< std::setw(12) << std::fixed << std::setprecision(0) << requests/t
+		<< std::setw(14) << std::setprecision(3) << (double) poller.connections/requests << std::endl;
+}
+
+int main(int argc, char** argv){
+	string addr = (argc > 1) ? argv[1] : "localhost:9003";
+	string path = (argc > 2) ? argv[2] : "/rest/v1/devices/";
+	double seconds = (argc > 3) ? strtod(argv[3], 0) : 3;
+
+	size_t colon = addr.rfind(':');
+	if (colon == string::npos || seconds <= 0){
+		std::cerr << "usage: rest_bench [host:port] [path] [seconds]" << std::endl;
+		return 1;
+	}
+
+	try{
+		Poller poller(addr.substr(0, colon), addr.substr(colon + 1), path);
+
+		std::cout << "GET http://" << addr << path << ", " << seconds << "s per client" << std::endl;
+		std::cout << std::setw(10) << "client" << std::setw(12) << "requests/s" << std::setw(14) << "conns/request" << std::endl;
+		run(poller, "close", 1, false, seconds);
+		run(poller, "keepalive", 1, true, seconds);
+		run(poller, "pipelined", PIPELINE_DEPTH, true, seconds);
+	}catch(std::exception& e){
+		std::cerr << "rest_bench: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
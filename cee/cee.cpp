@@ -63,32 +63,56 @@ CEE_device::CEE_device(libusb_device *dev, libusb_device_descriptor &desc):
 	channel_a_v("v", "Voltage A", "V",  V_min, V_max, 1,  V_max/2048, 1),
 	channel_a_i("i", "Current A", "mA", 0,     0,     2,  1,          2),
 	channel_b_v("v", "Voltage B", "V",  V_min, V_max, 1,  V_max/2048, 1),
-	channel_b_i("i", "Current B", "mA", 0,     0,     2,  1,          2)
+	channel_b_i("i", "Current B", "mA", 0,     0,     2,  1,          2),
+	
+	captureGeneration(0),
+	cache(model(), serial)
 	{
 	cerr << "Found a CEE: \n    Serial: "<< serial << endl;
 	
 	char buf[64];
 	int r;
-	r = controlTransfer(0xC0, 0x00, 0, 0, (uint8_t*)buf, 64);
-	if (r >= 0){
-		_hwversion = string(buf, strnlen(buf, r));
-	}
-
+	
+	// The firmware and git versions validate the cache; the rest comes from
+	// the cache if they match what it was saved with.
 	r = controlTransfer(0xC0, 0x00, 0, 1, (uint8_t*)buf, 64);
 	if (r >= 0){
 		_fwversion = string(buf, strnlen(buf, r));
 	}
+	
+	if (_fwversion >= "1.2"){
+		r = controlTransfer(0xC0, 0x00, 0, 2, (uint8_t*)buf, 64);
+		if (r >= 0){
+			_gitversion = string(buf, strnlen(buf, r));
+		}
+	}
+	
+	string cachedFw, cachedGit;
+	bool cacheValid = cache.get("fwversion", cachedFw) && cachedFw == _fwversion
+		&& cache.get("gitversion", cachedGit) && cachedGit == _gitversion
+		&& cache.get("hwversion", _hwversion);
+	
+	if (!cacheValid){
+		cache.clear();
+		cache.set("fwversion", _fwversion);
+		cache.set("gitversion", _gitversion);
+		
+		r = controlTransfer(0xC0, 0x00, 0, 0, (uint8_t*)buf, 64);
+		if (r >= 0){
+			_hwversion = string(buf, strnlen(buf, r));
+			cache.set("hwversion", _hwversion);
+		}
+	}
 
 	CEE_version_descriptor version_info;
 	bool have_version_info = 0;
 
 	if (_fwversion >= "1.2"){
-		r = controlTransfer(0xC0, 0x00, 0, 0xff, (uint8_t*)&version_info, sizeof(version_info));
-		have_version_info = (r>=0);
-
-		r = controlTransfer(0xC0, 0x00, 0, 2, (uint8_t*)buf, 64);
-		if (r >= 0){
-			_gitversion = string(buf, strnlen(buf, r));
+		have_version_info = cacheValid && cache.getBinary("version_info", &version_info, sizeof(version_info));
+		if (!have_version_info){
+			r = controlTransfer(0xC0, 0x00, 0, 0xff, (uint8_t*)&version_info, sizeof(version_info));
+			have_version_info = (r>=0);
+			if (have_version_info) cache.setBinary("version_info", &version_info, sizeof(version_info));
 		}
 	}
 
@@ -118,11 +142,13 @@ CEE_device::CEE_device(libusb_device *dev, libusb_device_descriptor &desc):
 	controlTransfer(0x40, CMD_CONFIG_GAIN, (0x01<<2), 3, 0, 0);
 
 	readCalibration();
+	cache.save();
 	
 	configure(0, CEE_default_sample_time, ceil(12.0/CEE_default_sample_time), true, false);
 }
 
 CEE_device::~CEE_device(){
+	stopIngest();
 	pause_capture();
 	delete channel_a.source;
 	delete channel_b.source;
@@ -133,6 +159,8 @@ void CEE_device::readCalibration(){
 		uint8_t buf[64];
 		uint32_t magic;
 	};
+	// Not cached: the EEPROM can be rewritten without a firmware change, and
+	// reading it costs the same single transfer as checking it would
 	int r = controlTransfer(0xC0, 0xE0, 0, 0, buf, 64);
 	if (!r || magic != EEPROM_VALID_MAGIC){
 		cerr << "    Reading calibration data failed " << r << endl;
@@ -155,9 +183,12 @@ void CEE_device::readCalibration(){
 	}
 	
 	cerr << "    Current gain " << cal.current_gain_a << " " << cal.current_gain_b << endl;
+	
+	buildTables();
 }
 
 bool CEE_device::processMessage(ClientConn& client, string& cmd, JSONNode& n){
+	state_lock lock(stateMutex);
 	if (cmd == "writeCalibration"){
 		cal.offset_a_v = jsonIntProp(n, "offset_a_v");
 		cal.offset_a_i = jsonIntProp(n, "offset_a_i");
@@ -171,6 +202,7 @@ bool CEE_device::processMessage(ClientConn& client, string& cmd, JSONNode& n){
 		cal.current_gain_b = jsonIntProp(n, "current_gain_b", (uint32_t) -1);
 		cal.flags = jsonIntProp(n, "flags", 0xff);
 		cal.magic = EEPROM_VALID_MAGIC;
+		buildTables();
 		
 		int r = controlTransfer(0x40, 0xE1, 0, 0, (uint8_t *)&cal, sizeof(cal));
 		
@@ -208,10 +240,14 @@ bool CEE_device::processMessage(ClientConn& client, string& cmd, JSONNode& n){
 		cal.offset_a_i = jsonIntProp(n, "offset_a_i", 0);
 		cal.offset_b_v = jsonIntProp(n, "offset_b_v", 0);
 		cal.offset_b_i = jsonIntProp(n, "offset_b_i", 0);
+		buildTables();
 		cerr << "Applied temporary calibration" << std::endl;
 		return true;
 		
 	}else{
+		// A raw transfer could change anything the cache holds
+		if (cmd == "controlTransfer") cache.clear();
+		
 		return USB_device::processMessage(client,cmd,n)
 			|| StreamingDevice::processMessage(client,cmd,n);
 	}
@@ -260,7 +296,9 @@ bool CEE_device::handleREST(UrlPath path, websocketpp::session_ptr client){
 }
 
 void CEE_device::configure(int mode, double _sampleTime, unsigned samples, bool continuous, bool raw){
+	state_lock lock(stateMutex);
 	pause_capture();
+	notifyStreamsChanging();
 	
 	// Clean up previous configuration
 	delete channel_a.source;
@@ -284,6 +322,7 @@ void CEE_device::configure(int mode, double _sampleTime, unsigned samples, bool
 	packets_per_transfer = ceil(BUFFER_TIME / (sampleTime * 10) / ntransfers);
 	
 	capture_i = capture_o = 0;
+	captureGeneration++;
 	
 	std::cerr << "CEE prepare "<< xmega_per << " " << ntransfers <<  " " << packets_per_transfer << " " << captureSamples << " " << currentLimit << std::endl;
 	
@@ -327,12 +366,10 @@ void CEE_device::configure(int mode, double _sampleTime, unsigned samples, bool
 			channel_b_i.max =  effectiveLimitB;
 		}
 		
-		channel_a_v.allocate(captureSamples);
-		channel_a_i.allocate(captureSamples);
-		channel_b_v.allocate(captureSamples);
-		channel_b_i.allocate(captureSamples);
+		allocateStreams(captureSamples);
 	}
 	
+	buildTables();
 	notifyConfig();
 }
 
@@ -355,6 +392,8 @@ void CEE_device::setCurrentLimit(unsigned mode){
 	controlTransfer(0xC0, CMD_ISET_DAC, ilimit_cal_a, ilimit_cal_b, NULL, 0);	
 	
 	currentLimit = mode;
+	stateChanged();
+	notifyStateDelta();
 }
 
 void CEE_device::on_reset_capture(){
@@ -387,7 +426,7 @@ void CEE_device::on_start_capture(){
 		out_transfers[i] = libusb_alloc_transfer(0);
 		const int osize = sizeof(OUT_packet)*packets_per_transfer;
 		buf = (unsigned char *) malloc(osize);
-		fillOutTransfer(buf);
+		fillOutTransfer(buf, packets_per_transfer);
 		outcount++;
 		libusb_fill_bulk_transfer(out_transfers[i], handle, EP_BULK_OUT, buf, osize, out_transfer_callback, this, 500);
 		out_transfers[i]->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
@@ -420,12 +459,18 @@ void CEE_device::on_pause_capture(){
 		}
 	}
 	
+	// Transfers that completed before user_data was zeroed may still be queued
+	// on the ingest thread
+	__sync_synchronize();
+	captureGeneration++;
+	
 	capture_o = capture_i;
 
 	releaseInterface();
 }
 
 void CEE_device::setInternalGain(Channel *channel, Stream* stream, int gain){
+	state_lock lock(stateMutex);
 	uint8_t streamval = 0, gainval=0;
 	
 	if (stream == &channel_a_i){
@@ -465,6 +510,7 @@ void CEE_device::setInternalGain(Channel *channel, Stream* stream, int gain){
 	}
 	
 	stream->gain = gain;
+	buildTables();
 	
 	if (captureState){
 		on_pause_capture();
@@ -476,22 +522,34 @@ void CEE_device::setInternalGain(Channel *channel, Stream* stream, int gain){
 		on_start_capture();
 	}
 	
-	std::cerr << "Set gain " << channel->id << " " << stream->id << " "
-	    << gain << " " << (int) streamval << " " << (int) gainval << std::endl;
+	logEvent(LOGLEVEL_INFO, LOGCAT_DEVICE, "Set gain %s %s %g %d %d",
+		channel->id.c_str(), stream->id.c_str(), (double) gain, (int) streamval, (int) gainval);
 	notifyGainChanged(channel, stream, gain);
 }
 
-void CEE_device::handleInTransfer(unsigned char *buffer){
-	float v_factor = 5.0/2048.0;
-	float i_factor_a = 2.5/2048.0/(cal.current_gain_a/CEE_current_gain_scale)*1000.0;
-	float i_factor_b = 2.5/2048.0/(cal.current_gain_b/CEE_current_gain_scale)*1000.0;
-	if (rawMode) v_factor = i_factor_a = i_factor_b = 1;
-			
-	for (int p=0; p<packets_per_transfer; p++){
+/// Runs in the ingest thread. `packets` is the number of packets in `buffer`,
+/// which was sized for the configuration it was queued under.
+void CEE_device::handleInTransfer(unsigned char *buffer, unsigned packets, unsigned generation, uint64_t postedAt){
+	if (ingestStopping){
+		free(buffer);
+		return;
+	}
+	
+	metrics.ingestLatency.observeSince(postedAt);
+	state_lock lock(stateMutex);
+	
+	if (generation != captureGeneration){
+		// from before a pause or configure; capture_i has moved on
+		free(buffer);
+		return;
+	}
+	
+	for (unsigned p=0; p<packets; p++){
 		IN_packet *pkt = &((IN_packet*)buffer)[p];
 	
 		if ((pkt->flags & FLAG_PACKET_DROPPED) && !firstPacket){
-			std::cerr << "Warning: dropped packet" << std::endl;
+			metrics.packetsDropped.add();
+			logEvent(LOGLEVEL_WARN, LOGCAT_INGEST, "Dropped packet");
 			JSONNode j;
 			j.push_back(JSONNode("_action", "packetDrop"));
 			broadcastJSON(j);
@@ -500,15 +558,16 @@ void CEE_device::handleInTransfer(unsigned char *buffer){
 		firstPacket = false;
 	
 		for (int i=0; i<10; i++){
-			put(channel_a_v, (cal.offset_a_v + pkt->data[i].av())*v_factor/channel_a_v.gain);
+			IN_sample& s = pkt->data[i];
+			putCode(channel_a_v, s.av(), table_a_v.value, s.av_code());
 			if ((pkt->mode_a & 0x3) != DISABLED){
-				put(channel_a_i, (cal.offset_a_i + pkt->data[i].ai())*i_factor_a/channel_a_i.gain);
+				putCode(channel_a_i, s.ai(), table_a_i.value, s.ai_code());
 			}else{
 				put(channel_a_i, 0);
 			}
-			put(channel_b_v, (cal.offset_b_v + pkt->data[i].bv())*v_factor/channel_b_v.gain);
+			putCode(channel_b_v, s.bv(), table_b_v.value, s.bv_code());
 			if ((pkt->mode_b & 0x3) != DISABLED){
-				put(channel_b_i, (cal.offset_b_i + pkt->data[i].bi())*i_factor_b/channel_b_i.gain);
+				putCode(channel_b_i, s.bi(), table_b_i.value, s.bi_code());
 			}else{
 				put(channel_b_i, 0);
 			}
@@ -517,12 +576,13 @@ void CEE_device::handleInTransfer(unsigned char *buffer){
 	}
 
 	free(buffer);
-	packetDone();
+	packetDone(postedAt);
 	checkOutputEffective(channel_a);
 	checkOutputEffective(channel_b);
 }
 
 void CEE_device::setOutput(Channel* channel, OutputSource* source){
+	state_lock lock(stateMutex);
 	{boost::mutex::scoped_lock lock(outputMutex);
 		
 		source->initialize(capture_o, channel->source);
@@ -550,17 +610,47 @@ inline float constrain(float val, float lo, float hi){
 }
 
 
-uint16_t CEE_device::encode_out(CEE_chanmode mode, float val, uint32_t igain){
+static void buildInputTable(CEE_input_table& table, int offset, double factor, unsigned gain){
+	for (unsigned code=0; code<4096; code++){
+		table.value[code] = (offset + signextend12(code))*(float)factor/gain;
+	}
+}
+
+void CEE_device::buildTables(){
+	float v_factor = 5.0/2048.0;
+	float i_factor_a = 2.5/2048.0/(cal.current_gain_a/CEE_current_gain_scale)*1000.0;
+	float i_factor_b = 2.5/2048.0/(cal.current_gain_b/CEE_current_gain_scale)*1000.0;
+	if (rawMode) v_factor = i_factor_a = i_factor_b = 1;
+	
+	buildInputTable(table_a_v, cal.offset_a_v, v_factor, channel_a_v.gain);
+	buildInputTable(table_a_i, cal.offset_a_i, i_factor_a, channel_a_i.gain);
+	buildInputTable(table_b_v, cal.offset_b_v, v_factor, channel_b_v.gain);
+	buildInputTable(table_b_i, cal.offset_b_i, i_factor_b, channel_b_i.gain);
+	
+	// The same conversions for compact streams, from the next sample on
+	unsigned oldest = buffer_min();
+	channel_a_v.setCodeScale(capture_i, v_factor/channel_a_v.gain, cal.offset_a_v, oldest);
+	channel_a_i.setCodeScale(capture_i, i_factor_a/channel_a_i.gain, cal.offset_a_i, oldest);
+	channel_b_v.setCodeScale(capture_i, v_factor/channel_b_v.gain, cal.offset_b_v, oldest);
+	channel_b_i.setCodeScale(capture_i, i_factor_b/channel_b_i.gain, cal.offset_b_i, oldest);
+	
+	// 4095*(1.25 + igain*val/1000)/2.5, as offset + scale*val
+	encoder_a.offset = encoder_b.offset = 4095*1.25/2.5;
+	encoder_a.scale = 4095*(cal.current_gain_a/CEE_current_gain_scale)/1000.0/2.5;
+	encoder_b.scale = 4095*(cal.current_gain_b/CEE_current_gain_scale)/1000.0/2.5;
+}
+
+uint16_t CEE_device::encode_out(CEE_chanmode mode, float val, const CEE_current_encoder& encoder){
 	if (rawMode){
 		return constrain(val, 0, 4095);
 	}else{
 		int v = 0;
 		if (mode == SVMI){
 			val = constrain(val, V_min, V_max);
-			v = 4095*val/5.0;
+			v = val*(4095/5.0);
 		}else if (mode == SIMV){
 			val = constrain(val, -currentLimit, currentLimit);
-			v = 4095*(1.25+(igain/CEE_current_gain_scale)*val/1000.0)/2.5;
+			v = encoder.offset + encoder.scale*val;
 		}
 		if (v > 4095) v=4095;
 		if (v < 0) v = 0;
@@ -569,14 +659,14 @@ uint16_t CEE_device::encode_out(CEE_chanmode mode, float val, uint32_t igain){
 	return 0;
 }
 
-void CEE_device::fillOutTransfer(unsigned char* buf){
+void CEE_device::fillOutTransfer(unsigned char* buf, unsigned packets){
 	boost::mutex::scoped_lock lock(outputMutex);
 	
 	uint8_t mode_a = channel_a.source->mode;
 	uint8_t mode_b = channel_b.source->mode;
 	
 	if (channel_a.source && channel_b.source){
-		for (int p=0; p<packets_per_transfer; p++){
+		for (unsigned p=0; p<packets; p++){
 			OUT_packet *pkt = &((OUT_packet *)buf)[p];
 
 			pkt->mode_a = mode_a;
@@ -584,14 +674,14 @@ void CEE_device::fillOutTransfer(unsigned char* buf){
 
 			for (int i=0; i<10; i++){
 				pkt->data[i].pack(
-					encode_out((CEE_chanmode)mode_a, channel_a.source->getValue(capture_o, sampleTime), cal.current_gain_a),
-					encode_out((CEE_chanmode)mode_b, channel_b.source->getValue(capture_o, sampleTime), cal.current_gain_b)
+					encode_out((CEE_chanmode)mode_a, channel_a.source->getValue(capture_o, sampleTime), encoder_a),
+					encode_out((CEE_chanmode)mode_b, channel_b.source->getValue(capture_o, sampleTime), encoder_b)
 				);
 				capture_o++;
 			}	
 		}
 	}else{
-		memset(buf, 0, sizeof(OUT_packet)*packets_per_transfer);
+		memset(buf, 0, sizeof(OUT_packet)*packets);
 	}
 	
 }
@@ -619,22 +709,34 @@ extern "C" void LIBUSB_CALL in_transfer_callback(libusb_transfer *t){
 	}
 
 	CEE_device *dev = (CEE_device *) t->user_data;
+	
+	// Read before user_data is checked again, so that a pause in between
+	// leaves this buffer tagged with the old generation
+	unsigned generation = dev->captureGeneration;
+	__sync_synchronize();
+	if (!t->user_data){
+		libusb_free_transfer(t);
+		return;
+	}
 
 	if (t->status == LIBUSB_TRANSFER_COMPLETED){
 		//cerr <<  millis() << " " << t << " complete " << t->actual_length << endl;
-		io.post(boost::bind(&CEE_device::handleInTransfer, dev, t->buffer));
-		t->buffer = (unsigned char*) malloc(sizeof(IN_packet) * dev->packets_per_transfer);
+		dev->metrics.inTransfers.add();
+		unsigned packets = t->actual_length / sizeof(IN_packet);
+		dev->ingest.post(boost::bind(&CEE_device::handleInTransfer, dev, t->buffer, packets, generation, monotonicMicros()));
+		t->buffer = (unsigned char*) malloc(t->length);
 
 		if (DISABLE_SELF_STOP || dev->captureContinuous || dev->incount*IN_SAMPLES_PER_PACKET < dev->captureSamples){
 			dev->incount++;
 			libusb_submit_transfer(t);
 		}else{
 			// don't submit more transfers, but wait for all the transfers to complete
-			cerr << "Queued last in packet" << endl;
+			logEvent(LOGLEVEL_DEBUG, LOGCAT_USB, "Queued last in packet");
 			destroy_transfer(dev, dev->in_transfers, t);
 		}
 	}else{
-		cerr << "ITransfer error "<< t->status << " " << t << endl;
+		dev->metrics.transferErrors.add();
+		logEvent(LOGLEVEL_ERROR, LOGCAT_USB, "ITransfer error %d %p", t->status, (void*) t);
 		//TODO: notify main thread of error
 		destroy_transfer(dev, dev->in_transfers, t);
 	}
@@ -652,14 +754,16 @@ extern "C" void LIBUSB_CALL out_transfer_callback(libusb_transfer *t){
 	CEE_device *dev = (CEE_device *) t->user_data;
 
 	if (t->status == LIBUSB_TRANSFER_COMPLETED){
+		dev->metrics.outTransfers.add();
 		if (DISABLE_SELF_STOP || dev->captureContinuous || dev->outcount*OUT_SAMPLES_PER_PACKET < dev->captureSamples){
-			dev->fillOutTransfer(t->buffer);
+			dev->fillOutTransfer(t->buffer, t->length / sizeof(OUT_packet));
 			dev->outcount++;
 			libusb_submit_transfer(t);
 		}
 		//cerr << outcount << " " << millis() << " " << t << " sent " << t->actual_length << endl;
 	}else{
-		cerr << "OTransfer error "<< t->status << " " << t << endl;
+		dev->metrics.transferErrors.add();
+		logEvent(LOGLEVEL_ERROR, LOGCAT_USB, "OTransfer error %d %p", t->status, (void*) t);
 		destroy_transfer(dev, dev->out_transfers, t);
 	}
 }
@@ -11,6 +11,7 @@
 #include "../dataserver.hpp"
 #include "../streaming_device/streaming_device.hpp"
 #include "../usb_device.hpp"
+#include "../device_cache.hpp"
 #include <boost/thread/mutex.hpp>
 
 enum CEE_chanmode{
@@ -30,6 +31,12 @@ struct IN_sample{
 	int16_t bv(){return signextend12((bih_bvh&0x0f)<<8) | bvl;}
 	int16_t ai(){return signextend12((aih_avh&0xf0)<<4) | ail;}
 	int16_t bi(){return signextend12((bih_bvh&0xf0)<<4) | bil;}
+	
+	/// Unsigned 12-bit codes, for indexing conversion tables
+	uint16_t av_code(){return ((aih_avh&0x0f)<<8) | avl;}
+	uint16_t bv_code(){return ((bih_bvh&0x0f)<<8) | bvl;}
+	uint16_t ai_code(){return ((aih_avh&0xf0)<<4) | ail;}
+	uint16_t bi_code(){return ((bih_bvh&0xf0)<<4) | bil;}
 } __attribute__((packed));
 
 #define IN_SAMPLES_PER_PACKET 10
@@ -84,6 +91,16 @@ typedef struct CEE_version_descriptor{
 
 #define N_TRANSFERS 64
 
+/// Value of a stream for each 12-bit ADC code, with calibration and gain applied
+struct CEE_input_table{
+	float value[4096];
+};
+
+/// Linear map from a current in mA to a DAC code, per channel
+struct CEE_current_encoder{
+	double offset, scale;
+};
+
 class CEE_device: public StreamingDevice, USB_device{
 	public: 
 	CEE_device(libusb_device *dev, libusb_device_descriptor &desc);
@@ -121,8 +138,8 @@ class CEE_device: public StreamingDevice, USB_device{
 
 	boost::mutex outputMutex;
 	boost::mutex transfersMutex;
-	void fillOutTransfer(unsigned char*);
-	void handleInTransfer(unsigned char*);
+	void fillOutTransfer(unsigned char*, unsigned packets);
+	void handleInTransfer(unsigned char*, unsigned packets, unsigned generation, uint64_t postedAt);
 	
 	virtual void setCurrentLimit(unsigned limit);
 
@@ -132,16 +149,31 @@ class CEE_device: public StreamingDevice, USB_device{
 	bool firstPacket;
 	
 	int ntransfers, packets_per_transfer;
+	
+	/// Bumped under stateMutex whenever the queued transfers stop belonging to
+	/// the current capture. IN buffers posted under an older generation are
+	/// dropped by handleInTransfer.
+	volatile unsigned captureGeneration;
 
 	protected:
 	string _hwversion, _fwversion, _gitversion;
 	virtual void on_reset_capture();
 	virtual void on_start_capture();
 	virtual void on_pause_capture();
-	uint16_t encode_out(CEE_chanmode mode, float val, uint32_t igain);
+	uint16_t encode_out(CEE_chanmode mode, float val, const CEE_current_encoder& encoder);
 	void checkOutputEffective(Channel& channel);
 	
 	EEPROM_cal cal;
+	
+	CEE_input_table table_a_v, table_a_i, table_b_v, table_b_i;
+	CEE_current_encoder encoder_a, encoder_b;
+	
+	/// Rebuild the conversion tables. Call with stateMutex held after changing
+	/// cal, a stream's gain or rawMode.
+	void buildTables();
+	
+	/// Version strings, descriptor and calibration from a previous plug-in
+	DeviceCache cache;
 
 	int min_per;
 	int xmega_per;
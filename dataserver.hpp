@@ -19,17 +19,39 @@ using std::string;
 extern boost::asio::io_service io;
 
 #include "libjson/libjson.h"
+#include "json_arena.hpp"
+#include "json_view.hpp"
 #include "websocketpp.hpp"
 void respondJSON(websocketpp::session_ptr client, JSONNode &n, int status=200);
 void respondError(websocketpp::session_ptr client, std::exception& e);
 
 #include "event.hpp"
 #include "device.hpp"
+#include "log.hpp"
 
 extern const char* const server_version;
 extern const char* const server_git_version;
 
-extern bool debugFlag;
+/// Store 12-bit samples as int16 codes instead of floats, halving buffer memory
+extern bool compactStorageFlag;
+
+/// Store a channel's streams in alternating blocks instead of separate arrays
+extern bool interleavedLayoutFlag;
+
+/// How capture buffers are backed: transparent huge pages are requested with
+/// madvise, explicit ones are mapped from the hugetlbfs pool.
+enum HugePagePolicy {HUGEPAGES_OFF, HUGEPAGES_TRANSPARENT, HUGEPAGES_EXPLICIT};
+extern HugePagePolicy hugePagesFlag;
+
+/// Touch capture buffers when they are allocated, so the first pass through
+/// the ring doesn't take page faults on the ingest thread
+extern bool prefaultBuffersFlag;
+
+/// mlock capture buffers so they can't be paged out
+extern bool lockBuffersFlag;
+
+/// Bytes of compressed history kept per compact stream, 0 for none
+extern size_t historyBytesFlag;
 
 extern std::set<device_ptr> devices;
 
@@ -7,26 +7,53 @@
 //   Kevin Mehall <km@kevinmehall.net>
 
 #include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include "dataserver.hpp"
 #include <iostream>
+#include <algorithm>
 
+/// Ids are computed once when the device is added, rather than on every lookup
+static boost::unordered_map<string, device_ptr> devicesById;
+static boost::unordered_map<string, std::vector<device_ptr> > devicesByModel;
 
-device_ptr getDeviceById(string id){
+/// Writers are on the main thread; readers may be on worker threads
+static boost::shared_mutex registryMutex;
+
+device_ptr getDeviceById(const string& id){
+	boost::shared_lock<boost::shared_mutex> lock(registryMutex);
 	if (id.at(id.size()-1) == '*'){
 		// Match a device type
-		id.resize(id.size()-1);
-		BOOST_FOREACH(device_ptr d, devices){
-			if (d->model() == id) return d;
-		}
+		boost::unordered_map<string, std::vector<device_ptr> >::iterator it =
+			devicesByModel.find(id.substr(0, id.size()-1));
+		if (it != devicesByModel.end() && it->second.size()) return it->second.front();
 	}else{
 		// Match a specific serial number
-		BOOST_FOREACH(device_ptr d, devices){
-			if (d->getId() == id) return d;
-		}
+		boost::unordered_map<string, device_ptr>::iterator it = devicesById.find(id);
+		if (it != devicesById.end()) return it->second;
 	}
 	return device_ptr();
 }
 
+void addDevice(device_ptr dev){
+	boost::unique_lock<boost::shared_mutex> lock(registryMutex);
+	devices.insert(dev);
+	devicesById[dev->getId()] = dev;
+	devicesByModel[dev->model()].push_back(dev);
+}
+
+void removeDevice(device_ptr dev){
+	boost::unique_lock<boost::shared_mutex> lock(registryMutex);
+	devices.erase(dev);
+	
+	boost::unordered_map<string, device_ptr>::iterator it = devicesById.find(dev->getId());
+	if (it != devicesById.end() && it->second == dev) devicesById.erase(it);
+	
+	std::vector<device_ptr>& sameModel = devicesByModel[dev->model()];
+	sameModel.erase(std::remove(sameModel.begin(), sameModel.end(), dev), sameModel.end());
+}
+
 void Device::broadcastJSON(JSONNode& n){
 	BOOST_FOREACH(ClientConn* c, connections){
 		c->sendJSON(n);
@@ -48,6 +75,7 @@ JSONNode Device::toJSON(){
 	n.push_back(JSONNode("hwVersion", hwVersion()));
 	n.push_back(JSONNode("fwVersion", fwVersion()));
 	n.push_back(JSONNode("serial", serialno()));
+	if (initTime) n.push_back(JSONNode("initTime", initTime));
 	return n;
 }
 
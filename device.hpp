@@ -14,12 +14,13 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include "url.hpp"
+#include "metrics.hpp"
 
 class ClientConn;
 
 class Device: public boost::enable_shared_from_this<Device> {
 	public: 
-		Device(){}
+		Device(): initTime(0){}
 		virtual ~Device(){};
 		
 		virtual JSONNode toJSON();
@@ -41,22 +42,53 @@ class Device: public boost::enable_shared_from_this<Device> {
 		virtual const string fwVersion(){return "unknown";}
 		
 		virtual bool processMessage(ClientConn& session, string& cmd, JSONNode& n){ return false; }
+		
+		/// Fast path for common commands, tried before the message is parsed with
+		/// libjson. Return false to have it parsed and passed to processMessage.
+		virtual bool processMessageView(ClientConn& session, string& cmd, JSONViewNode& n){ return false; }
+		
+		/// Whether processMessageView takes /cmd/. Other messages skip the view.
+		virtual bool handlesMessageView(const string& cmd){ return false; }
+		virtual bool processBinaryMessage(ClientConn& session, const std::vector<unsigned char>& data){ return false; }
 		virtual bool handleREST(UrlPath path, websocketpp::session_ptr client){return false;}
 		
 		virtual void onDisconnect();
 		
+		/// Add this device's samples to the /metrics page. Main thread.
+		virtual void writeMetrics(MetricsWriter& m){}
+		
+		/// Milliseconds spent in the constructor, which probes the hardware
+		double initTime;
+		
 		protected:
 			void broadcastJSON(JSONNode &n);
 };
 
 typedef boost::shared_ptr<Device> device_ptr;
 
-device_ptr getDeviceById(string id);
+/// Look up a device by id, or the first of a model by "model*". Safe to call
+/// from any thread.
+device_ptr getDeviceById(const string& id);
+
+/// Add to or remove from `devices` and the id index. Main thread only.
+void addDevice(device_ptr dev);
+void removeDevice(device_ptr dev);
 
 class ClientConn{
 	public:
+		ClientConn(): stateDeltas(false){
+			static unsigned nextId = 0;
+			id = ++nextId;
+		}
+		
 		device_ptr device;
 		
+		/// Distinguishes clients in the metrics
+		unsigned id;
+		
+		/// Client asked for deviceDelta patches instead of deviceConfig messages
+		bool stateDeltas;
+		
 	virtual ~ClientConn(){
 		if (device) device->onClientDetach(this);
 	}
@@ -70,5 +102,12 @@ class ClientConn{
 	}
 	
 	virtual void sendJSON(JSONNode &n) = 0;
+	
+	/// Send a message carrying samples that arrived from USB at /stamp/
+	/// (monotonicMicros), recording their age when sent in /age/.
+	virtual void sendJSON(JSONNode &n, uint64_t stamp, boost::shared_ptr<MetricHistogram> age){
+		sendJSON(n);
+		if (stamp) age->observeSince(stamp);
+	}
 };
 
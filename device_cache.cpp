@@ -0,0 +1,122 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// On-disk cache of device metadata
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include "device_cache.hpp"
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(p) _mkdir(p)
+#else
+#define make_dir(p) mkdir(p, 0755)
+#endif
+
+string deviceCacheDir;
+
+void deviceCacheInit(){
+#ifdef _WIN32
+	const char* base = getenv("APPDATA");
+	if (base) deviceCacheDir = string(base) + "\\Nonolith Connect";
+#else
+	const char* base = getenv("HOME");
+	if (base) deviceCacheDir = string(base) + "/.nonolith-connect";
+#endif
+}
+
+static bool validName(const string& s){
+	if (s.empty()) return false;
+	for (unsigned i=0; i<s.size(); i++){
+		char c = s[i];
+		if (!(isalnum(c) || c == '.' || c == '-' || c == '_')) return false;
+	}
+	return true;
+}
+
+DeviceCache::DeviceCache(const string& model, const string& serial){
+	if (deviceCacheDir.empty() || !validName(model) || !validName(serial)) return;
+	path = deviceCacheDir + "/" + model + "~" + serial;
+	
+	std::ifstream f(path.c_str());
+	string line;
+	while (std::getline(f, line)){
+		string::size_type sep = line.find('=');
+		if (sep != string::npos) entries[line.substr(0, sep)] = line.substr(sep+1);
+	}
+}
+
+bool DeviceCache::get(const string& key, string& value){
+	std::map<string, string>::iterator it = entries.find(key);
+	if (it == entries.end()) return false;
+	value = it->second;
+	return true;
+}
+
+void DeviceCache::set(const string& key, const string& value){
+	if (value.find('\n') != string::npos) return;
+	entries[key] = value;
+}
+
+bool DeviceCache::getBinary(const string& key, void* data, size_t size){
+	string hex;
+	if (!get(key, hex) || hex.size() != size*2) return false;
+	
+	unsigned char* out = (unsigned char*) data;
+	for (size_t i=0; i<size; i++){
+		unsigned v;
+		if (sscanf(hex.c_str() + i*2, "%2x", &v) != 1) return false;
+		out[i] = v;
+	}
+	return true;
+}
+
+void DeviceCache::setBinary(const string& key, const void* data, size_t size){
+	static const char digits[] = "0123456789abcdef";
+	const unsigned char* in = (const unsigned char*) data;
+	string hex(size*2, '0');
+	for (size_t i=0; i<size; i++){
+		hex[i*2] = digits[in[i] >> 4];
+		hex[i*2+1] = digits[in[i] & 0xf];
+	}
+	entries[key] = hex;
+}
+
+void DeviceCache::save(){
+	if (path.empty()) return;
+	make_dir(deviceCacheDir.c_str());
+	
+	// Write a temporary file and rename it, so a crash can't leave a partial cache
+	string tmp = path + ".tmp";
+	{
+		std::ofstream f(tmp.c_str());
+		for (std::map<string, string>::iterator it=entries.begin(); it!=entries.end(); it++){
+			f << it->first << '=' << it->second << '\n';
+		}
+		if (!f){
+			std::cerr << "    Could not write device cache " << tmp << std::endl;
+			return;
+		}
+	}
+	remove(path.c_str());
+	if (rename(tmp.c_str(), path.c_str()) != 0){
+		std::cerr << "    Could not replace device cache " << path << ": " << strerror(errno) << std::endl;
+		remove(tmp.c_str());
+	}
+}
+
+void DeviceCache::clear(){
+	entries.clear();
+	if (!path.empty()) remove(path.c_str());
+}
@@ -0,0 +1,44 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// On-disk cache of device metadata
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+#include <string>
+#include <map>
+using std::string;
+
+/// Directory holding the cache files, or empty to disable the cache
+extern string deviceCacheDir;
+
+/// Sets deviceCacheDir to the per-user default
+void deviceCacheInit();
+
+/// Key/value metadata for one device, kept in a file named by its serial
+/// number. Lets a device skip the control transfers for data that doesn't
+/// change between plug-ins, once a cheap check against the device passes.
+class DeviceCache{
+	public:
+		DeviceCache(const string& model, const string& serial);
+		
+		bool get(const string& key, string& value);
+		void set(const string& key, const string& value);
+		
+		/// Binary values are stored hex-encoded
+		bool getBinary(const string& key, void* data, size_t size);
+		void setBinary(const string& key, const void* data, size_t size);
+		
+		/// Write the entries back to disk
+		void save();
+		
+		/// Forget all entries, e.g. when the device may have been changed behind
+		/// the cache's back
+		void clear();
+		
+	private:
+		string path;
+		std::map<string, string> entries;
+};
@@ -8,6 +8,7 @@
 
 #include "dataserver.hpp"
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 
 void EventListener::subscribe(Event& e, void_function h){
 	unsubscribe();
@@ -24,6 +25,7 @@ void EventListener::unsubscribe(){
 }
 
 void Event::notify(){
+	generation++;
 	for (std::set<EventListener*>::iterator it=listeners.begin(); it!=listeners.end();){
 		EventListener* e = *it;
 		it++; // Increment before calling handler in case the handler removes this listener,
@@ -32,6 +34,21 @@ void Event::notify(){
 	}
 }
 
+void Event::post(){
+	boost::mutex::scoped_lock lock(postMutex);
+	if (posted) return;
+	posted = true;
+	io.post(boost::bind(&Event::deliver, this));
+}
+
+void Event::deliver(){
+	{
+		boost::mutex::scoped_lock lock(postMutex);
+		posted = false;
+	}
+	notify();
+}
+
 Event::~Event(){
 	BOOST_FOREACH(EventListener* e, listeners){
 		e->event = 0;
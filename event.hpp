@@ -12,6 +12,7 @@
 #endif
 
 #include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
 
 typedef boost::function<void()> void_function;
 
@@ -35,11 +36,27 @@ class EventListener{
 
 class Event{
 	public:
-		Event(){}
+		Event(): generation(0), posted(false){}
 		~Event();
+		
+		/// Call the handlers now, on the calling thread, which must be the main thread
 		void notify();
+		
+		/// Call the handlers on the main thread. May be called from any thread.
+		/// Posts before the handlers run are coalesced into one notify.
+		void post();
+		
+		/// Incremented by every notify, so a subscriber can cache work derived
+		/// from the event's state and share it with the other subscribers.
+		unsigned generation;
+		
 		std::set<EventListener*> listeners;
 	private:
+		boost::mutex postMutex;
+		bool posted;
+		void deliver();
+		
+
 		Event(const Event&);
    		Event& operator=(const Event&);
 };
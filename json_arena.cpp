@@ -0,0 +1,274 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Message-scoped arena allocator for libjson nodes
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include "json_arena.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <boost/thread/tss.hpp>
+
+#ifndef JSON_MEMORY_CALLBACKS
+#error "json_arena requires JSON_MEMORY_CALLBACKS in libjson/JSONOptions.h"
+#endif
+
+const size_t ARENA_CHUNK_SIZE = 64*1024;
+const size_t ARENA_MAX_BLOCK = ARENA_CHUNK_SIZE/4; // larger blocks go to malloc
+const unsigned ARENA_RETAIN_CHUNKS = 4; // chunks kept across a reset
+const size_t ARENA_ALIGN = 16;
+
+class JSONArena;
+
+/// Prefixed to every block handed to libjson, so free and realloc can tell
+/// arena blocks from heap blocks. Padded to ARENA_ALIGN.
+struct BlockHeader{
+	JSONArena* owner; // 0 for heap blocks
+	size_t size;
+};
+
+static inline BlockHeader* headerOf(void* p){
+	return reinterpret_cast<BlockHeader*>((char*) p - ARENA_ALIGN);
+}
+
+static inline void* dataOf(BlockHeader* h){
+	return (char*) h + ARENA_ALIGN;
+}
+
+static inline size_t alignUp(size_t n){
+	return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static volatile unsigned long stat_allocations = 0;
+static volatile unsigned long stat_heapAllocations = 0;
+static volatile unsigned long stat_bytes = 0;
+static volatile unsigned long stat_resets = 0;
+static volatile unsigned long stat_deferredResets = 0;
+static volatile unsigned long stat_chunks = 0;
+static volatile unsigned long stat_peakBytes = 0;
+
+class JSONArena{
+	public:
+		JSONArena(): depth(0), live(1), cur(0), ptr(0), end(0), last(0), used(0){}
+
+		~JSONArena(){
+			for (unsigned i=0; i<chunks.size(); i++) std::free(chunks[i]);
+			__sync_fetch_and_sub(&stat_chunks, chunks.size());
+		}
+
+		unsigned depth;
+		
+		/// Blocks handed out and not yet freed, plus one held by the owning
+		/// thread until it exits. Whoever drops it to zero deletes the arena,
+		/// so nodes that outlive their thread keep its chunks alive.
+		volatile long live;
+
+		void* alloc(size_t n){
+			size_t need = ARENA_ALIGN + alignUp(n);
+			if (ptr + need > end && !nextChunk()) return 0;
+
+			BlockHeader* h = reinterpret_cast<BlockHeader*>(ptr);
+			h->owner = this;
+			h->size = n;
+			ptr += need;
+			used += need;
+			last = dataOf(h);
+
+			__sync_fetch_and_add(&live, 1);
+			__sync_fetch_and_add(&stat_allocations, 1);
+			__sync_fetch_and_add(&stat_bytes, need);
+			return last;
+		}
+
+		/// Grow the most recent block in place, if there's room in its chunk.
+		bool extend(void* p, size_t n){
+			if (p != last) return false;
+			BlockHeader* h = headerOf(p);
+			char* blockEnd = (char*) p + alignUp(n);
+			if (blockEnd > end) return false;
+			if (blockEnd <= ptr){
+				h->size = n;
+				return true;
+			}
+
+			size_t grow = blockEnd - ptr;
+			used += grow;
+			__sync_fetch_and_add(&stat_bytes, grow);
+			ptr = blockEnd;
+			h->size = n;
+			return true;
+		}
+
+		/// May be called from any thread. The arena may be deleted on return.
+		void release(){
+			if (__sync_sub_and_fetch(&live, 1) == 0) delete this;
+		}
+
+		void reset(){
+			if (live > 1){
+				__sync_fetch_and_add(&stat_deferredResets, 1);
+				return;
+			}
+
+			unsigned long peak;
+			while ((peak = stat_peakBytes) < used){
+				if (__sync_bool_compare_and_swap(&stat_peakBytes, peak, used)) break;
+			}
+
+			while (chunks.size() > ARENA_RETAIN_CHUNKS){
+				std::free(chunks.back());
+				chunks.pop_back();
+				__sync_fetch_and_sub(&stat_chunks, 1);
+			}
+
+			cur = 0;
+			ptr = end = 0;
+			last = 0;
+			if (chunks.size()){
+				ptr = chunks[0];
+				end = ptr + ARENA_CHUNK_SIZE;
+			}
+			used = 0;
+			__sync_fetch_and_add(&stat_resets, 1);
+		}
+
+	private:
+		std::vector<char*> chunks;
+		unsigned cur;
+		char* ptr;
+		char* end;
+		void* last;
+		size_t used;
+
+		bool nextChunk(){
+			if (ptr) cur++;
+			if (cur >= chunks.size()){
+				char* c = (char*) std::malloc(ARENA_CHUNK_SIZE);
+				if (!c) return false;
+				chunks.push_back(c);
+				__sync_fetch_and_add(&stat_chunks, 1);
+				cur = chunks.size() - 1;
+			}
+			ptr = chunks[cur];
+			end = ptr + ARENA_CHUNK_SIZE;
+			return true;
+		}
+};
+
+/// Thread exit drops the owning thread's reference rather than deleting
+static void orphanArena(JSONArena* a){
+	a->release();
+}
+
+static boost::thread_specific_ptr<JSONArena> threadArena(orphanArena);
+
+static inline JSONArena* activeArena(){
+	JSONArena* a = threadArena.get();
+	return (a && a->depth) ? a : 0;
+}
+
+static void* heap_malloc(size_t n){
+	BlockHeader* h = (BlockHeader*) std::malloc(ARENA_ALIGN + n);
+	if (!h) return 0;
+	h->owner = 0;
+	h->size = n;
+	__sync_fetch_and_add(&stat_heapAllocations, 1);
+	return dataOf(h);
+}
+
+static void* arena_malloc(size_t n){
+	JSONArena* a = activeArena();
+	if (a && n <= ARENA_MAX_BLOCK){
+		if (void* p = a->alloc(n)) return p;
+	}
+	return heap_malloc(n);
+}
+
+static void arena_free(void* p){
+	if (!p) return;
+	BlockHeader* h = headerOf(p);
+	if (h->owner) h->owner->release();
+	else std::free(h);
+}
+
+static void* arena_realloc(void* p, size_t n){
+	if (!p) return arena_malloc(n);
+	BlockHeader* h = headerOf(p);
+
+	if (!h->owner){
+		h = (BlockHeader*) std::realloc(h, ARENA_ALIGN + n);
+		if (!h) return 0;
+		h->size = n;
+		return dataOf(h);
+	}
+
+	if (h->owner == activeArena() && n <= ARENA_MAX_BLOCK && h->owner->extend(p, n)){
+		return p;
+	}
+
+	void* q = arena_malloc(n);
+	if (!q) return 0;
+	std::memcpy(q, p, (h->size < n) ? h->size : n);
+	h->owner->release();
+	return q;
+}
+
+void jsonArenaInit(){
+	libjson::register_memory_callbacks(arena_malloc, arena_realloc, arena_free);
+}
+
+JSONArenaScope::JSONArenaScope(){
+	JSONArena* a = threadArena.get();
+	if (!a){
+		a = new JSONArena();
+		threadArena.reset(a);
+	}
+	a->depth++;
+}
+
+JSONArenaScope::~JSONArenaScope(){
+	JSONArena* a = threadArena.get();
+	if (--a->depth == 0) a->reset();
+}
+
+JSONArenaPause::JSONArenaPause(): savedDepth(0){
+	if (JSONArena* a = threadArena.get()){
+		savedDepth = a->depth;
+		a->depth = 0;
+	}
+}
+
+JSONArenaPause::~JSONArenaPause(){
+	if (JSONArena* a = threadArena.get()){
+		a->depth = savedDepth;
+	}
+}
+
+JSONArenaStats jsonArenaStats(){
+	JSONArenaStats s;
+	s.allocations = stat_allocations;
+	s.heapAllocations = stat_heapAllocations;
+	s.bytes = stat_bytes;
+	s.resets = stat_resets;
+	s.deferredResets = stat_deferredResets;
+	s.chunks = stat_chunks;
+	s.peakBytes = stat_peakBytes;
+	return s;
+}
+
+void jsonArenaStatsJSON(JSONNode& n){
+	JSONArenaStats s = jsonArenaStats();
+	JSONNode a(JSON_NODE);
+	a.set_name("arena");
+	a.push_back(JSONNode("allocations", s.allocations));
+	a.push_back(JSONNode("heapAllocations", s.heapAllocations));
+	a.push_back(JSONNode("bytes", s.bytes));
+	a.push_back(JSONNode("resets", s.resets));
+	a.push_back(JSONNode("deferredResets", s.deferredResets));
+	a.push_back(JSONNode("chunks", s.chunks));
+	a.push_back(JSONNode("peakBytes", s.peakBytes));
+	n.push_back(a);
+}
@@ -0,0 +1,49 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Message-scoped arena allocator for libjson nodes
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include <cstddef>
+#include "libjson/libjson.h"
+
+/// Installs the arena as libjson's memory callbacks. Must be called before any
+/// JSONNode is created, because blocks are freed through the same callbacks.
+void jsonArenaInit();
+
+/// While a scope is alive, libjson nodes built on this thread are bump-allocated
+/// from the thread's arena. The arena is reset when the outermost scope ends
+/// if none of its blocks are still live, so declare the scope before the nodes
+/// it covers and don't store them past the scope.
+struct JSONArenaScope{
+	JSONArenaScope();
+	~JSONArenaScope();
+};
+
+/// Suspends an enclosing JSONArenaScope so that nodes built inside outlive it.
+struct JSONArenaPause{
+	JSONArenaPause();
+	~JSONArenaPause();
+	private:
+		unsigned savedDepth;
+};
+
+/// Allocator counters, summed over all threads.
+struct JSONArenaStats{
+	unsigned long allocations; ///< blocks handed out from arenas
+	unsigned long heapAllocations; ///< blocks that went to malloc (no scope, or too large)
+	unsigned long bytes; ///< bytes handed out from arenas
+	unsigned long resets;
+	unsigned long deferredResets; ///< scope ends that found blocks still live
+	unsigned long chunks; ///< chunks currently held
+	unsigned long peakBytes; ///< most bytes used by one arena between resets
+};
+
+JSONArenaStats jsonArenaStats();
+
+/// Adds the allocator counters to n as an "arena" object.
+void jsonArenaStatsJSON(JSONNode& n);
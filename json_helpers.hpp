@@ -13,50 +13,60 @@ struct ErrorStringException : public std::exception{
    virtual ~ErrorStringException() throw() {}
 };
 
-inline string jsonStringProp(JSONNode &n, const char* prop){
-	JSONNode::iterator i = n.find(prop);
+// These take either a JSONNode or a JSONViewNode.
+
+template <class Node>
+inline string jsonStringProp(Node &n, const char* prop){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_STRING) return i->as_string();
 	else throw ErrorStringException(string("JSON missing string property: ") + prop);
 }
 
-inline bool jsonBoolProp(JSONNode &n, const char* prop){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline bool jsonBoolProp(Node &n, const char* prop){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_BOOL) return i->as_bool();
 	else throw ErrorStringException(string("JSON missing bool property: ") + prop);
 }
 
-inline int jsonIntProp(JSONNode &n, const char* prop){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline int jsonIntProp(Node &n, const char* prop){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_NUMBER) return i->as_int();
 	else throw ErrorStringException(string("JSON missing int property: ") + prop);
 }
 
-inline double jsonFloatProp(JSONNode &n, const char* prop){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline double jsonFloatProp(Node &n, const char* prop){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_NUMBER) return i->as_float();
 	else throw ErrorStringException(string("JSON missing float property: ") + prop);
 }
 
-inline string jsonStringProp(JSONNode &n, const char* prop, string def){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline string jsonStringProp(Node &n, const char* prop, string def){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_STRING) return i->as_string();
 	else return def;
 }
 
-inline int jsonIntProp(JSONNode &n, const char* prop, int def){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline int jsonIntProp(Node &n, const char* prop, int def){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_NUMBER) return i->as_int();
 	else return def;
 }
 
-inline bool jsonBoolProp(JSONNode &n, const char* prop, bool def){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline bool jsonBoolProp(Node &n, const char* prop, bool def){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_BOOL) return i->as_bool();
 	else return def;
 }
 
-inline double jsonFloatProp(JSONNode &n, const char* prop, double def){
-	JSONNode::iterator i = n.find(prop);
+template <class Node>
+inline double jsonFloatProp(Node &n, const char* prop, double def){
+	typename Node::iterator i = n.find(prop);
 	if (i != n.end() && i->type() == JSON_NUMBER) return i->as_float();
 	else return def;
 }
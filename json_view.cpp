@@ -0,0 +1,288 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Single-pass JSON tokenizer for inbound commands
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include "json_view.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cctype>
+
+const unsigned JSON_VIEW_MAX_DEPTH = 128;
+
+bool jsonPeekString(const std::string& text, const char* key, std::string& value){
+	std::string quoted = std::string("\"") + key + "\"";
+	size_t p = text.find(quoted);
+	if (p == std::string::npos) return false;
+	p += quoted.size();
+	
+	while (p < text.size() && isspace(text[p])) p++;
+	if (p >= text.size() || text[p] != ':') return false;
+	p++;
+	while (p < text.size() && isspace(text[p])) p++;
+	if (p >= text.size() || text[p] != '"') return false;
+	p++;
+	
+	size_t end = text.find('"', p);
+	if (end == std::string::npos) return false;
+	value.assign(text, p, end - p);
+	return true;
+}
+
+unsigned JSONViewNode::size() const {
+	unsigned n = 0;
+	for (iterator i = begin(); i != end(); ++i) n++;
+	return n;
+}
+
+JSONViewNode::iterator JSONViewNode::find(const char* name) const {
+	size_t len = strlen(name);
+	iterator i = begin(), e = end();
+	for (; i != e; ++i){
+		const JSONViewToken& t = i->tok();
+		if (t.nameLen == len && memcmp(t.name, name, len) == 0) break;
+	}
+	return i;
+}
+
+JSONViewNode JSONViewNode::at(const char* name) const {
+	iterator i = find(name);
+	if (i == end()) throw std::out_of_range(std::string("JSON missing property: ") + name);
+	return *i;
+}
+
+static inline void skipWhitespace(char*& p){
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+}
+
+static inline int hexDigit(char c){
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static bool readHex4(char*& p, unsigned& v){
+	v = 0;
+	for (int i=0; i<4; i++){
+		int d = hexDigit(*p++);
+		if (d < 0) return false;
+		v = (v << 4) | d;
+	}
+	return true;
+}
+
+static void writeUTF8(char*& w, unsigned c){
+	if (c < 0x80){
+		*w++ = c;
+	}else if (c < 0x800){
+		*w++ = 0xC0 | (c >> 6);
+		*w++ = 0x80 | (c & 0x3F);
+	}else if (c < 0x10000){
+		*w++ = 0xE0 | (c >> 12);
+		*w++ = 0x80 | ((c >> 6) & 0x3F);
+		*w++ = 0x80 | (c & 0x3F);
+	}else{
+		*w++ = 0xF0 | (c >> 18);
+		*w++ = 0x80 | ((c >> 12) & 0x3F);
+		*w++ = 0x80 | ((c >> 6) & 0x3F);
+		*w++ = 0x80 | (c & 0x3F);
+	}
+}
+
+/// p points at the opening quote. The decoded string is written over the
+/// source text, which is never shorter than its decoding.
+bool JSONView::parseString(char*& p, const char*& str, unsigned& len){
+	char* w = ++p;
+	str = w;
+	for (;;){
+		char c = *p++;
+		if (c == '"') break;
+		if ((unsigned char) c < 0x20) return false; // includes the terminating NUL
+		if (c != '\\'){
+			*w++ = c;
+			continue;
+		}
+		switch (*p++){
+			case '"':  *w++ = '"'; break;
+			case '\\': *w++ = '\\'; break;
+			case '/':  *w++ = '/'; break;
+			case 'b':  *w++ = '\b'; break;
+			case 'f':  *w++ = '\f'; break;
+			case 'n':  *w++ = '\n'; break;
+			case 'r':  *w++ = '\r'; break;
+			case 't':  *w++ = '\t'; break;
+			case 'u':{
+				unsigned u;
+				if (!readHex4(p, u)) return false;
+				if (u >= 0xD800 && u < 0xDC00 && p[0] == '\\' && p[1] == 'u'){
+					p += 2;
+					unsigned lo;
+					if (!readHex4(p, lo) || lo < 0xDC00 || lo >= 0xE000) return false;
+					u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+				}
+				writeUTF8(w, u);
+				break;
+			}
+			default: return false;
+		}
+	}
+	len = w - str;
+	return true;
+}
+
+static bool matchLiteral(char*& p, const char* lit){
+	size_t n = strlen(lit);
+	if (strncmp(p, lit, n) != 0) return false;
+	p += n;
+	return true;
+}
+
+bool JSONView::parseScalar(char*& p, JSONViewToken& t){
+	t.str = p;
+	t.num = 0;
+
+	if (*p == '"'){
+		t.type = JSON_STRING;
+		return parseString(p, t.str, t.len);
+	}else if (*p == 't' || *p == 'f'){
+		t.type = JSON_BOOL;
+		t.num = (*p == 't');
+		if (!matchLiteral(p, t.num ? "true" : "false")) return false;
+	}else if (*p == 'n'){
+		t.type = JSON_NULL;
+		if (!matchLiteral(p, "null")) return false;
+	}else{
+		// Check the JSON number grammar, which is stricter than strtod's
+		char* q = p;
+		if (*q == '-') q++;
+		if (*q == '0') q++;
+		else if (*q >= '1' && *q <= '9') while (*q >= '0' && *q <= '9') q++;
+		else return false;
+		if (*q == '.'){
+			q++;
+			if (!(*q >= '0' && *q <= '9')) return false;
+			while (*q >= '0' && *q <= '9') q++;
+		}
+		if (*q == 'e' || *q == 'E'){
+			q++;
+			if (*q == '+' || *q == '-') q++;
+			if (!(*q >= '0' && *q <= '9')) return false;
+			while (*q >= '0' && *q <= '9') q++;
+		}
+		t.type = JSON_NUMBER;
+		t.num = strtod(p, 0);
+		p = q;
+	}
+
+	t.len = p - t.str;
+	return true;
+}
+
+void JSONView::begin(const std::string& text){
+	buf.assign(text.begin(), text.end());
+	buf.push_back(0);
+	tokens.clear();
+	stack.clear();
+	
+	// Dense numeric arrays average a token per 5-6 bytes; reserving up front
+	// avoids copying the token array while a large message is parsed.
+	tokens.reserve(text.size()/5);
+
+	cur = &buf[0];
+	bufEnd = cur + text.size();
+	pendingName = 0;
+	pendingNameLen = 0;
+	state = VALUE;
+}
+
+JSONView::Status JSONView::step(unsigned budget){
+	char* p = cur;
+	const char* name = pendingName;
+	unsigned nameLen = pendingNameLen;
+
+	for (unsigned n = 0;; n++){
+		if (n >= budget){
+			cur = p;
+			pendingName = name;
+			pendingNameLen = nameLen;
+			return MORE;
+		}
+
+		if (state == KEY){
+			skipWhitespace(p);
+			if (*p != '"' || !parseString(p, name, nameLen)) return INVALID;
+			skipWhitespace(p);
+			if (*p++ != ':') return INVALID;
+			state = VALUE;
+
+		}else if (state == VALUE){
+			skipWhitespace(p);
+			JSONViewToken t;
+			t.name = name;
+			t.nameLen = nameLen;
+			name = 0;
+			nameLen = 0;
+
+			if (*p == '{' || *p == '['){
+				if (stack.size() >= JSON_VIEW_MAX_DEPTH) return INVALID;
+				t.type = (*p == '{') ? JSON_NODE : JSON_ARRAY;
+				t.str = p;
+				t.len = 0;
+				t.num = 0;
+				stack.push_back(tokens.size());
+				tokens.push_back(t);
+
+				char close = (*p++ == '{') ? '}' : ']';
+				skipWhitespace(p);
+				if (*p == close){
+					p++;
+					tokens.back().end = tokens.size();
+					stack.pop_back();
+					state = AFTER;
+				}else{
+					state = (close == '}') ? KEY : VALUE;
+				}
+			}else{
+				if (!parseScalar(p, t)) return INVALID;
+				t.end = tokens.size() + 1;
+				tokens.push_back(t);
+				state = AFTER;
+			}
+
+		}else{ // AFTER
+			skipWhitespace(p);
+			if (stack.empty()){
+				return (p == bufEnd) ? DONE : INVALID;
+			}
+
+			JSONViewToken& parent = tokens[stack.back()];
+			char close = (parent.type == JSON_NODE) ? '}' : ']';
+			if (*p == ','){
+				p++;
+				state = (parent.type == JSON_NODE) ? KEY : VALUE;
+			}else if (*p == close){
+				p++;
+				parent.end = tokens.size();
+				stack.pop_back();
+			}else{
+				return INVALID;
+			}
+		}
+	}
+}
+
+bool JSONView::parse(const std::string& text){
+	begin(text);
+	return step(UINT_MAX) == DONE;
+}
+
+void JSONView::release(){
+	std::vector<char>().swap(buf);
+	std::vector<JSONViewToken>().swap(tokens);
+	std::vector<unsigned>().swap(stack);
+}
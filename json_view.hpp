@@ -0,0 +1,135 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Single-pass JSON tokenizer for inbound commands
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "libjson/libjson.h"
+
+class JSONView;
+
+/// One value in a JSONView. Containers are followed by their children, and
+/// `end` is the index just past the value's subtree.
+struct JSONViewToken{
+	char type; // libjson's JSON_NODE, JSON_ARRAY, JSON_STRING, ...
+	unsigned end;
+	const char* name;
+	unsigned nameLen;
+	const char* str; // decoded string, or the literal text of other scalars
+	unsigned len;
+	double num;
+};
+
+class JSONViewIterator;
+
+/// Read-only handle to a value in a JSONView, with the subset of the JSONNode
+/// interface used by the command handlers, so they can be templated on either.
+class JSONViewNode{
+	public:
+		JSONViewNode(): view(0), idx(0){}
+		JSONViewNode(const JSONView* v, unsigned i): view(v), idx(i){}
+
+		typedef JSONViewIterator iterator;
+
+		char type() const { return tok().type; }
+		std::string name() const { return std::string(tok().name, tok().nameLen); }
+		std::string as_string() const { return std::string(tok().str, tok().len); }
+		double as_float() const { return tok().num; }
+		int as_int() const { return (int) tok().num; }
+		bool as_bool() const { return tok().num != 0; }
+		unsigned size() const;
+
+		inline iterator begin() const;
+		inline iterator end() const;
+		iterator find(const char* name) const;
+
+		/// Throws std::out_of_range if there is no child with that name.
+		JSONViewNode at(const char* name) const;
+
+	private:
+		const JSONView* view;
+		unsigned idx;
+		inline const JSONViewToken& tok() const;
+
+		friend class JSONViewIterator;
+};
+
+class JSONViewIterator{
+	public:
+		JSONViewIterator(const JSONView* v, unsigned i): node(v, i){}
+		JSONViewNode& operator*(){ return node; }
+		JSONViewNode* operator->(){ return &node; }
+		inline JSONViewIterator& operator++();
+		JSONViewIterator operator++(int){ JSONViewIterator r = *this; ++*this; return r; }
+		bool operator==(const JSONViewIterator& o) const { return node.idx == o.node.idx; }
+		bool operator!=(const JSONViewIterator& o) const { return node.idx != o.node.idx; }
+	private:
+		JSONViewNode node;
+};
+
+/// Find the string value of /key/ by scanning for its quoted name, without
+/// parsing. Only a hint: the same text inside another string fools it.
+bool jsonPeekString(const std::string& text, const char* key, std::string& value);
+
+/// Tokenizes a whole message in one pass. Strings are unescaped in place in
+/// the view's copy of the text and numbers are converted as they are read.
+/// The view must outlive the JSONViewNodes taken from it.
+class JSONView{
+	public:
+		enum Status {MORE, DONE, INVALID};
+		
+		/// Returns false if the text is not valid JSON.
+		bool parse(const std::string& text);
+		
+		/// Incremental form of parse: begin, then call step until it returns
+		/// DONE or INVALID. Each step reads at most `budget` tokens.
+		void begin(const std::string& text);
+		Status step(unsigned budget);
+		
+		/// Free the buffers, which keep their size between parses otherwise.
+		void release();
+
+		JSONViewNode root() const { return JSONViewNode(this, 0); }
+
+	private:
+		enum ParseState {VALUE, KEY, AFTER};
+		
+		std::vector<char> buf;
+		std::vector<JSONViewToken> tokens;
+		std::vector<unsigned> stack;
+		
+		char* cur;
+		char* bufEnd;
+		const char* pendingName;
+		unsigned pendingNameLen;
+		ParseState state;
+
+		bool parseString(char*& p, const char*& str, unsigned& len);
+		bool parseScalar(char*& p, JSONViewToken& t);
+
+		friend class JSONViewNode;
+};
+
+inline const JSONViewToken& JSONViewNode::tok() const {
+	return view->tokens[idx];
+}
+
+inline JSONViewNode::iterator JSONViewNode::begin() const {
+	return iterator(view, idx + 1);
+}
+
+inline JSONViewNode::iterator JSONViewNode::end() const {
+	return iterator(view, tok().end);
+}
+
+inline JSONViewIterator& JSONViewIterator::operator++(){
+	node.idx = node.tok().end;
+	return *this;
+}
@@ -1,6 +1,15 @@
 #ifndef JSON_OPTIONS_H
 #define JSON_OPTIONS_H
 
+/*
+ *  JSON_FAST is the release profile, selected with `scons json_fast=1`.  It drops the
+ *  debug assertions, comment stripping, the validator, JSONStream and the case-insensitive
+ *  lookups, none of which the server uses.  JSON_SAFE stays on because parse() is fed
+ *  straight from the network: it makes libjson null out malformed values instead of
+ *  asserting.  Neither profile parses strictly; bench/json_bench.cpp checks what gets
+ *  through in each.
+ */
+
 /**
  *  This file holds all of the compiling options for easy access and so
  *  that you don't have to remember them, or look them up all the time
@@ -28,7 +37,9 @@
  *  it simply tells you about them, which is nice for debugging, but not preferable
  *  for release candidates
  */
+#ifndef JSON_FAST
 #define JSON_DEBUG
+#endif
 
 
 /*
@@ -117,7 +128,9 @@
  *  your json into a stream, which will automatically hit a callback when full nodes are
  *  completed
  */
+#ifndef JSON_FAST
 #define JSON_STREAM
+#endif
 
 
 /*
@@ -127,7 +140,15 @@
  *  pool.  With this option turned on, the default behavior is still done internally unless
  *  a callback is registered.  So you can have this option on and not use it.
  */
-//#define JSON_MEMORY_CALLBACKS
+#define JSON_MEMORY_CALLBACKS
+
+
+/*
+ *  JSON_STRING_STD_ALLOCATOR keeps json_string a plain std::string when memory callbacks
+ *  or the memory pool are enabled, so only nodes and child arrays go through the
+ *  callbacks and strings can still be passed to and from the library without copying.
+ */
+#define JSON_STRING_STD_ALLOCATOR
 
 
 /*
@@ -223,7 +244,9 @@
  *  parsing json that has comments in it as it simply ignores them, but with this option
  *  it keeps the comments and allows you to insert further comments
  */
+#ifndef JSON_FAST
 #define JSON_COMMENTS
+#endif
 
 
 /*
@@ -253,14 +276,18 @@
 /*
  *  JSON_VALIDATE turns on validation features of libjson.
  */
+#ifndef JSON_FAST
 #define JSON_VALIDATE
+#endif
 
 
 /*
  *  JSON_CASE_INSENSITIVE_FUNCTIONS turns on funtions for finding child nodes in a case-
  *  insenititve way
  */
+#ifndef JSON_FAST
 #define JSON_CASE_INSENSITIVE_FUNCTIONS
+#endif
 
 
 /*
@@ -1,6 +1,6 @@
 #include "JSONAllocator.h"
 
-#if defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+#if (defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR)
 #include "JSONMemory.h"
 
 void * JSONAllocatorRelayer::alloc(size_t bytes) json_nothrow {
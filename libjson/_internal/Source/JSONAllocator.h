@@ -2,7 +2,7 @@
 #define JSON_ALLOCATOR_H
 
 #include "JSONStats.h"
-#if defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+#if (defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR)
 
 #include <cstddef>
 
@@ -26,7 +26,7 @@
 #define JSON_NODE '\5'
 
 #ifdef __cplusplus
-	#if defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+	#if (defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR)
 		#include "JSONAllocator.h"
 	#else
 		#define json_allocator std::allocator
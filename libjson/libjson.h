@@ -207,14 +207,14 @@
 		
 		#ifndef JSON_STRING_HEADER
 			inline static std::string to_std_string(const json_string & str){
-				#if defined(JSON_UNICODE) ||defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+				#if defined(JSON_UNICODE) || ((defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR))
 					return std::string(str.begin(), str.end());		
 				#else
 					return str;
 				#endif
 			}
 			inline static std::wstring to_std_wstring(const json_string & str){
-				#if (!defined(JSON_UNICODE)) || defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+				#if (!defined(JSON_UNICODE)) || ((defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR))
 					return std::wstring(str.begin(), str.end());		
 				#else
 					return str;
@@ -222,14 +222,14 @@
 			}
 			
 			inline static json_string to_json_string(const std::string & str){
-				#if defined(JSON_UNICODE) ||defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+				#if defined(JSON_UNICODE) || ((defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR))
 					return json_string(str.begin(), str.end());		
 				#else
 					return str;
 				#endif
 			}
 			inline static json_string to_json_string(const std::wstring & str){
-				#if (!defined(JSON_UNICODE)) || defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)
+				#if (!defined(JSON_UNICODE)) || ((defined(JSON_MEMORY_CALLBACKS) || defined(JSON_MEMORY_POOL)) && !defined(JSON_STRING_STD_ALLOCATOR))
 					return json_string(str.begin(), str.end());		
 				#else
 					return str;
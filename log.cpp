@@ -0,0 +1,254 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Event log ring
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "dataserver.hpp"
+#include "log.hpp"
+
+#ifndef _WIN32
+#include <syslog.h>
+#endif
+
+LogLevel logLevelFlag = LOGLEVEL_INFO;
+string logTargetFlag;
+
+static const char* const levelNames[] = {"debug", "info", "warn", "error"};
+static const char* const categoryNames[] = {"server", "usb", "ingest", "device", "client"};
+
+/// A record is published by storing seq+1 in `ready` after its other fields.
+/// Readers check it before and after copying, and drop the copy if a writer
+/// lapped them in between. A writer doesn't take a slot until the record from
+/// the previous lap has been published.
+struct LogRecord{
+	volatile unsigned long ready;
+	uint64_t time;
+	unsigned char level;
+	unsigned char category;
+	char text[LOG_TEXT_SIZE];
+};
+
+static LogRecord ring[LOG_RING_SIZE];
+
+/// Sequence number of the next record to be claimed
+static volatile unsigned long head = 0;
+
+/// Next record for the drain thread to write out
+static unsigned long drained = 0;
+
+/// Difference between the wall clock and monotonicMicros, to date records
+static uint64_t wallOffset;
+
+static boost::thread* drainThread = 0;
+static volatile bool drainStop = false;
+static FILE* logFile = 0;
+
+void logEvent(LogLevel level, LogCategory category, const char* fmt, ...){
+	if (level < logLevelFlag) return;
+	
+	unsigned long seq = __sync_fetch_and_add(&head, 1);
+	LogRecord& r = ring[seq % LOG_RING_SIZE];
+	
+	// Only waits if LOG_RING_SIZE events were logged while the writer of
+	// this slot's last record was still formatting it
+	unsigned long previous = (seq < LOG_RING_SIZE) ? 0 : seq + 1 - LOG_RING_SIZE;
+	while (r.ready != previous) boost::this_thread::yield();
+	
+	r.ready = 0;
+	__sync_synchronize();
+	
+	r.time = monotonicMicros();
+	r.level = level;
+	r.category = category;
+	
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(r.text, LOG_TEXT_SIZE, fmt, args);
+	va_end(args);
+	
+	__sync_synchronize();
+	r.ready = seq + 1;
+}
+
+/// Copy out record /seq/. Returns 1 if copied, 0 if it hasn't been written
+/// yet, or -1 if it has been overwritten.
+static int readRecord(unsigned long seq, LogRecord& out){
+	const LogRecord& r = ring[seq % LOG_RING_SIZE];
+	unsigned long ready = r.ready;
+	if (ready > seq + 1) return -1;
+	if (ready != seq + 1) return (head - seq > LOG_RING_SIZE) ? -1 : 0;
+	
+	__sync_synchronize();
+	memcpy(&out, &r, sizeof(out));
+	__sync_synchronize();
+	
+	return (r.ready == seq + 1) ? 1 : -1;
+}
+
+static void writeRecord(const LogRecord& r){
+#ifndef _WIN32
+	if (logTargetFlag == "syslog"){
+		static const int priorities[] = {LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR};
+		syslog(priorities[r.level], "%s: %s", categoryNames[r.category], r.text);
+		return;
+	}
+#endif
+	
+	if (logFile){
+		uint64_t t = r.time + wallOffset;
+		time_t secs = t / 1000000;
+		char date[32];
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+		fprintf(logFile, "%s.%06u %s %s: %s\n", date, (unsigned) (t % 1000000),
+			levelNames[r.level], categoryNames[r.category], r.text);
+	}else{
+		fprintf(stderr, "%s: %s\n", categoryNames[r.category], r.text);
+	}
+}
+
+/// Write out the records finished since the last call. Drain thread only.
+static void drain(){
+	unsigned long lost = 0;
+	
+	unsigned long end = head;
+	if (end - drained > LOG_RING_SIZE){
+		lost = end - LOG_RING_SIZE - drained;
+		drained = end - LOG_RING_SIZE;
+	}
+	
+	while (drained != end){
+		LogRecord r;
+		int status = readRecord(drained, r);
+		if (status == 0) break; // still being written
+		if (status < 0) lost++;
+		else writeRecord(r);
+		drained++;
+	}
+	
+	if (lost){
+		LogRecord r;
+		r.time = monotonicMicros();
+		r.level = LOGLEVEL_WARN;
+		r.category = LOGCAT_SERVER;
+		snprintf(r.text, LOG_TEXT_SIZE, "Log ring overran; lost %lu records", lost);
+		writeRecord(r);
+	}
+	
+	if (logFile) fflush(logFile);
+}
+
+static void drainMain(){
+	while (!drainStop){
+		drain();
+		boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+	}
+}
+
+void logInit(){
+	uint64_t wall = (boost::posix_time::microsec_clock::universal_time()
+		- boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1))).total_microseconds();
+	wallOffset = wall - monotonicMicros();
+	
+	if (logTargetFlag == "syslog"){
+#ifndef _WIN32
+		openlog("nonolith-connect", LOG_PID, LOG_DAEMON);
+#else
+		std::cerr << "syslog is not available on this platform" << std::endl;
+		logTargetFlag = "";
+#endif
+	}else if (!logTargetFlag.empty()){
+		logFile = fopen(logTargetFlag.c_str(), "a");
+		if (!logFile){
+			std::cerr << "Could not open log file " << logTargetFlag << std::endl;
+		}
+	}
+	
+	drainThread = new boost::thread(drainMain);
+}
+
+void logShutdown(){
+	if (!drainThread) return;
+	drainStop = true;
+	drainThread->join();
+	delete drainThread;
+	drainThread = 0;
+	drain();
+	if (logFile) fclose(logFile);
+	logFile = 0;
+}
+
+LogLevel logLevelByName(const string& name){
+	for (unsigned i=0; i<sizeof(levelNames)/sizeof(levelNames[0]); i++){
+		if (name == levelNames[i]) return (LogLevel) i;
+	}
+	throw ErrorStringException("Unknown log level");
+}
+
+static int categoryByName(const string& name){
+	for (unsigned i=0; i<LOGCAT_COUNT; i++){
+		if (name == categoryNames[i]) return i;
+	}
+	throw ErrorStringException("Unknown log category");
+}
+
+void logRequest(UrlPath path, websocketpp::session_ptr client){
+	unsigned long end = head;
+	unsigned long since;
+	LogLevel level;
+	int category;
+	try{
+		since = path.param_num<unsigned long>("since", 0);
+		level = logLevelByName(path.param("level", "debug"));
+		category = path.param("category", "").empty() ? -1 : categoryByName(path.param("category", ""));
+	}catch(std::exception& e){
+		JSONNode j;
+		j.push_back(JSONNode("error", e.what()));
+		respondJSON(client, j, 400);
+		return;
+	}
+	
+	// Only the records still in the ring are available
+	bool truncated = false;
+	if (end - since > LOG_RING_SIZE || since > end){
+		since = (end > LOG_RING_SIZE) ? end - LOG_RING_SIZE : 0;
+		truncated = true;
+	}
+	
+	JSONNode records(JSON_ARRAY);
+	records.set_name("records");
+	
+	for (unsigned long seq=since; seq<end; seq++){
+		LogRecord r;
+		int status = readRecord(seq, r);
+		if (status == 0) break;
+		if (status < 0){
+			truncated = true;
+			continue;
+		}
+		if (r.level < level || (category >= 0 && r.category != category)) continue;
+		
+		JSONNode n(JSON_NODE);
+		n.push_back(JSONNode("seq", seq));
+		n.push_back(JSONNode("time", (r.time + wallOffset) / 1e6));
+		n.push_back(JSONNode("level", levelNames[r.level]));
+		n.push_back(JSONNode("category", categoryNames[r.category]));
+		n.push_back(JSONNode("message", r.text));
+		records.push_back(n);
+	}
+	
+	JSONNode n(JSON_NODE);
+	n.push_back(JSONNode("next", end));
+	n.push_back(JSONNode("truncated", truncated));
+	n.push_back(records);
+	respondJSON(client, n);
+}
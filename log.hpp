@@ -0,0 +1,58 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Event log ring
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include "websocketpp.hpp"
+#include "url.hpp"
+using std::string;
+
+// Not LOG_*, which syslog.h defines
+enum LogLevel {LOGLEVEL_DEBUG, LOGLEVEL_INFO, LOGLEVEL_WARN, LOGLEVEL_ERROR};
+
+enum LogCategory {
+	LOGCAT_SERVER, ///< startup, REST requests
+	LOGCAT_USB,    ///< transfer callbacks, hotplug
+	LOGCAT_INGEST, ///< sample processing on a device's ingest thread
+	LOGCAT_DEVICE, ///< capture state and configuration
+	LOGCAT_CLIENT, ///< websocket messages and sessions
+	LOGCAT_COUNT
+};
+
+/// Messages longer than this are truncated
+const unsigned LOG_TEXT_SIZE = 232;
+
+/// Records kept in memory for the drainer and /rest/v1/log
+const unsigned LOG_RING_SIZE = 4096;
+
+/// Records below this level are discarded. Set by the "log-level=" flag;
+/// "debug" also lowers it to LOGLEVEL_DEBUG.
+extern LogLevel logLevelFlag;
+
+/// Where the drainer writes: "" for stderr, a file path, or "syslog"
+extern string logTargetFlag;
+
+/// Record a printf-style message. Safe to call from any thread; does no IO,
+/// which is left to the drain thread, and only waits if the ring laps a
+/// writer that hasn't finished.
+void logEvent(LogLevel level, LogCategory category, const char* fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/// Start the drain thread, after the flags are parsed
+void logInit();
+
+/// Write out whatever the drain thread hasn't, and stop it
+void logShutdown();
+
+/// Parse a level name, e.g. "warn"
+LogLevel logLevelByName(const string& name);
+
+/// GET /rest/v1/log?since=seq&level=name&category=name
+void logRequest(UrlPath path, websocketpp::session_ptr client);
@@ -0,0 +1,122 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Data path metrics in the Prometheus text format
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include "dataserver.hpp"
+#include "metrics.hpp"
+#include <sstream>
+#include <boost/foreach.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t monotonicMicros(){
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	// Split the conversion so q * 1000000 can't overflow after days of uptime
+	uint64_t q = t.QuadPart, f = freq.QuadPart;
+	return (q / f) * 1000000 + (q % f) * 1000000 / f;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+#endif
+}
+
+MetricHistogram::MetricHistogram(): count(0), sum(0){
+	for (unsigned i=0; i<METRIC_HISTOGRAM_BUCKETS; i++) buckets[i] = 0;
+}
+
+string metricLabel(const char* key, const string& value, const string& labels){
+	string r = labels.empty() ? "{" : labels.substr(0, labels.size()-1) + ",";
+	r += string(key) + "=\"";
+	BOOST_FOREACH(char c, value){
+		if (c == '\\' || c == '"') r += '\\';
+		if (c == '\n'){ r += "\\n"; continue; }
+		r += c;
+	}
+	return r + "\"}";
+}
+
+MetricsWriter::Family& MetricsWriter::family(const char* name, const char* type, const char* help){
+	Family& f = families[name];
+	f.type = type;
+	f.help = help;
+	return f;
+}
+
+void MetricsWriter::counter(const char* name, const char* help, const string& labels, unsigned long value){
+	std::ostringstream o;
+	o << name << labels << ' ' << value;
+	family(name, "counter", help).samples.push_back(o.str());
+}
+
+void MetricsWriter::gauge(const char* name, const char* help, const string& labels, double value){
+	std::ostringstream o;
+	o << name << labels << ' ' << value;
+	family(name, "gauge", help).samples.push_back(o.str());
+}
+
+void MetricsWriter::histogram(const char* name, const char* help, const string& labels, const MetricHistogram& h){
+	Family& f = family(name, "histogram", help);
+	
+	// Buckets are exposed in seconds and cumulative
+	unsigned long cumulative = 0;
+	for (unsigned b=0; b<METRIC_HISTOGRAM_BUCKETS; b++){
+		cumulative += h.buckets[b];
+		std::ostringstream le;
+		if (b == METRIC_HISTOGRAM_BUCKETS-1) le << "+Inf";
+		else le << (1ul << b) / 1e6;
+		
+		std::ostringstream o;
+		o << name << "_bucket" << metricLabel("le", le.str(), labels) << ' ' << cumulative;
+		f.samples.push_back(o.str());
+	}
+	
+	std::ostringstream sum, count;
+	sum << name << "_sum" << labels << ' ' << h.sum / 1e6;
+	count << name << "_count" << labels << ' ' << h.count;
+	f.samples.push_back(sum.str());
+	f.samples.push_back(count.str());
+}
+
+string MetricsWriter::text(){
+	std::ostringstream o;
+	for (std::map<string, Family>::iterator it=families.begin(); it!=families.end(); it++){
+		o << "# HELP " << it->first << ' ' << it->second.help << '\n';
+		o << "# TYPE " << it->first << ' ' << it->second.type << '\n';
+		BOOST_FOREACH(const string& s, it->second.samples){
+			o << s << '\n';
+		}
+	}
+	return o.str();
+}
+
+void handleMetricsRequest(websocketpp::session_ptr client){
+	MetricsWriter m;
+	
+	m.gauge("connect_devices", "Attached devices", "", devices.size());
+	BOOST_FOREACH(device_ptr d, devices){
+		d->writeMetrics(m);
+	}
+	
+	websocketMetrics(m);
+	
+	JSONArenaStats a = jsonArenaStats();
+	m.counter("connect_json_arena_allocations_total", "JSON nodes allocated from arenas", "", a.allocations);
+	m.counter("connect_json_arena_heap_allocations_total", "JSON nodes allocated with malloc", "", a.heapAllocations);
+	m.gauge("connect_json_arena_chunks", "Chunks held by JSON arenas", "", a.chunks);
+	
+	client->set_header("Content-Type", "text/plain; version=0.0.4");
+	client->start_http(200, m.text());
+}
@@ -0,0 +1,81 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Data path metrics in the Prometheus text format
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "websocketpp.hpp"
+using std::string;
+
+/// Microseconds since an arbitrary start. Unlike the wall clock, never goes
+/// backwards.
+uint64_t monotonicMicros();
+
+/// Updated with atomic adds, so any thread can count without a lock.
+struct MetricCounter{
+	MetricCounter(): value(0){}
+	volatile unsigned long value;
+	void add(unsigned long n=1){ __sync_fetch_and_add(&value, n); }
+};
+
+/// Buckets are powers of two from 1us to about 1s, plus one for larger values
+const unsigned METRIC_HISTOGRAM_BUCKETS = 21;
+
+/// Distribution of durations in microseconds, updated with atomic adds
+struct MetricHistogram{
+	MetricHistogram();
+	volatile unsigned long buckets[METRIC_HISTOGRAM_BUCKETS];
+	volatile unsigned long count;
+	volatile unsigned long sum;
+	
+	void observe(unsigned long us){
+		unsigned b = 0;
+		while (b < METRIC_HISTOGRAM_BUCKETS-1 && us > (1ul << b)) b++;
+		__sync_fetch_and_add(&buckets[b], 1);
+		__sync_fetch_and_add(&count, 1);
+		__sync_fetch_and_add(&sum, us);
+	}
+	
+	/// Observe the time since /start/, from monotonicMicros
+	void observeSince(uint64_t start){
+		observe(monotonicMicros() - start);
+	}
+};
+
+/// Collects samples from the devices and clients, grouped by metric name as
+/// the format requires.
+class MetricsWriter{
+	public:
+		void counter(const char* name, const char* help, const string& labels, unsigned long value);
+		void gauge(const char* name, const char* help, const string& labels, double value);
+		void histogram(const char* name, const char* help, const string& labels, const MetricHistogram& h);
+		
+		string text();
+		
+	private:
+		struct Family{
+			string type;
+			string help;
+			std::vector<string> samples;
+		};
+		std::map<string, Family> families;
+		Family& family(const char* name, const char* type, const char* help);
+};
+
+/// Format a label set, e.g. metricLabel("device", id) gives {device="id"}.
+/// Pass an existing set as /labels/ to add to it.
+string metricLabel(const char* key, const string& value, const string& labels="");
+
+/// Metrics of the websocket clients, in websocket_service.cpp
+void websocketMetrics(MetricsWriter& m);
+
+/// Respond to GET /metrics with every device's and client's metrics
+void handleMetricsRequest(websocketpp::session_ptr client);
@@ -22,7 +22,7 @@ void respondJSON(websocketpp::session_ptr client, JSONNode &n, int status){
 void respondError(websocketpp::session_ptr client, std::exception& e){
 	JSONNode j;
 	j.push_back(JSONNode("error", e.what()));
-	std::cerr << "Exception while processing request: " << e.what() <<std::endl;
+	logEvent(LOGLEVEL_WARN, LOGCAT_SERVER, "Exception while processing request: %s", e.what());
 	respondJSON(client, j, 402);
 }
 
@@ -52,8 +52,11 @@ void handleJSONRequest(UrlPath path, websocketpp::session_ptr client){
 			n.push_back(JSONNode("server", "Nonolith Connect"));
 			n.push_back(JSONNode("version", server_version));
 			n.push_back(JSONNode("gitVersion", server_git_version));
+			jsonArenaStatsJSON(n);
 			respondJSON(client, n);
 			return;
+		}else if (path1.matches("log")){
+			return logRequest(path1, client);
 		}else if (path1.matches("devices")){
 			UrlPath path2 = path1.sub();
 			
@@ -11,10 +11,13 @@
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/regex.hpp>
+#include <limits>
 
 #include "dataserver.hpp"
 #include "websocket_handler.hpp"
 #include "url.hpp"
+#include "device_cache.hpp"
+#include "metrics.hpp"
 
 using boost::asio::ip::tcp;
 const unsigned short port = 9003;
@@ -22,7 +25,12 @@ const unsigned short port = 9003;
 std::set <device_ptr> devices;
 boost::asio::io_service io;
 
-bool debugFlag = false;
+bool compactStorageFlag = false;
+size_t historyBytesFlag = 0;
+bool interleavedLayoutFlag = false;
+HugePagePolicy hugePagesFlag = HUGEPAGES_TRANSPARENT;
+bool prefaultBuffersFlag = true;
+bool lockBuffersFlag = false;
 bool allowRemote = false;
 bool allowAnyOrigin = false;
 
@@ -30,6 +38,8 @@ Event device_list_changed;
 Event capture_state_changed;
 
 int main(int argc, char* argv[]){	
+	jsonArenaInit();
+	deviceCacheInit();
 	data_server_handler_ptr handler(new data_server_handler());
 	
 	try {
@@ -37,11 +47,30 @@ int main(int argc, char* argv[]){
 		
 		for (int i=1; i<argc; i++){
 			string arg(argv[i]);
-			if (arg=="debug") debugFlag = true;
+			if (arg=="debug") logLevelFlag = LOGLEVEL_DEBUG;
+			if (arg.compare(0, 10, "log-level=") == 0) logLevelFlag = logLevelByName(arg.substr(10));
+			if (arg.compare(0, 9, "log-file=") == 0) logTargetFlag = arg.substr(9);
+			if (arg=="syslog") logTargetFlag = "syslog";
+			if (arg=="compact-storage") compactStorageFlag = true;
+			if (arg=="layout=interleaved") interleavedLayoutFlag = true;
+			if (arg=="hugepages=off") hugePagesFlag = HUGEPAGES_OFF;
+			if (arg=="hugepages=explicit") hugePagesFlag = HUGEPAGES_EXPLICIT;
+			if (arg=="no-prefault") prefaultBuffersFlag = false;
+			if (arg=="lock-buffers") lockBuffersFlag = true;
+			if (arg.compare(0, 11, "history-mb=") == 0){
+				unsigned long mb;
+				parse_num(arg.c_str() + 11, arg.size() - 11, mb);
+				if (mb > std::numeric_limits<size_t>::max() / (1024*1024)) throw ErrorStringException("history-mb is too large");
+				historyBytesFlag = (size_t) mb * 1024 * 1024;
+				compactStorageFlag = true;
+			}
 			if (arg=="allow-remote") allowRemote = true;
 			if (arg=="allow-any-origin") allowAnyOrigin = true;
+			if (arg=="no-device-cache") deviceCacheDir = "";
 		}
 		
+		logInit();
+		
 		boost::asio::ip::address_v4 bind_addr;
 		if (!allowRemote) bind_addr = boost::asio::ip::address_v4::loopback();
 		
@@ -59,6 +88,7 @@ int main(int argc, char* argv[]){
 		std::cerr << "Exception: " << e.what() << std::endl;
 	}
 	
+	logShutdown();
 	return 0;
 }
 
@@ -82,11 +112,10 @@ void data_server_handler::on_client_connect(websocketpp::session_ptr client){
 		return;
 	}
 	
-	const std::string resource = client->get_resource();
-	Url url(resource);
-	UrlPath path(url, 1);
-
 	try{
+		Url url(client->get_resource());
+		UrlPath path(url, 1);
+		
 		if (path.leaf()){ // "/"
 			client->set_header("Location", redir_url);
 			client->start_http(301);
@@ -94,6 +123,8 @@ void data_server_handler::on_client_connect(websocketpp::session_ptr client){
 			handleJSONRequest(path.sub(), client);
 		}else if (path.matches("ws")){
 			client->start_websocket();
+		}else if (path.matches("metrics")){
+			handleMetricsRequest(client);
 		}else{
 			client->start_http(404, "Not found");
 		}
@@ -0,0 +1,305 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Synchronized capture across multiple streaming devices
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include <iostream>
+#include <memory>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "device_group.hpp"
+
+// The ingest threads take link->mutex while holding their device's
+// stateMutex, so the main thread must not call into a device while holding it.
+
+DeviceGroup::~DeviceGroup(){
+	{
+		boost::mutex::scoped_lock lock(link->mutex);
+		link->group = 0;
+	}
+	clearAllListeners();
+}
+
+void DeviceGroup::prune(){
+	bool lost = false;
+	BOOST_FOREACH(GroupMember& m, members){
+		if (devices.find(m.device) == devices.end()) lost = true;
+	}
+	if (!lost) return;
+	
+	// Every listener reads the lost member's capture counter, so none of them
+	// can go on. Cancel them while it's still a member so it drops them too.
+	clearAllListeners();
+	
+	boost::mutex::scoped_lock lock(link->mutex);
+	for (std::vector<GroupMember>::iterator it=members.begin(); it!=members.end();){
+		if (devices.find(it->device) == devices.end()){
+			it = members.erase(it);
+		}else{
+			it++;
+		}
+	}
+}
+
+void DeviceGroup::setDevices(const std::vector<string>& ids){
+	clearAllListeners();
+	
+	std::vector<GroupMember> newMembers;
+	BOOST_FOREACH(const string& id, ids){
+		streaming_device_ptr d = boost::dynamic_pointer_cast<StreamingDevice>(getDeviceById(id));
+		if (!d) throw ErrorStringException("Device not found: " + id);
+		BOOST_FOREACH(GroupMember& m, newMembers){
+			if (m.device == d) throw ErrorStringException("Device listed twice: " + id);
+		}
+		newMembers.push_back(GroupMember(d));
+	}
+	
+	boost::mutex::scoped_lock lock(link->mutex);
+	members.swap(newMembers);
+	captureState = false;
+}
+
+GroupMember* DeviceGroup::memberById(const string& id){
+	BOOST_FOREACH(GroupMember& m, members){
+		if (m.device->getId() == id) return &m;
+	}
+	return 0;
+}
+
+void DeviceGroup::start_capture(){
+	prune();
+	if (members.empty()) throw ErrorStringException("Device group is empty");
+	
+	double sampleTime = members[0].device->sampleTime;
+	BOOST_FOREACH(GroupMember& m, members){
+		if (m.device->sampleTime != sampleTime)
+			throw ErrorStringException("Devices in a group must have the same sample time");
+	}
+	
+	clearAllListeners();
+	
+	BOOST_FOREACH(GroupMember& m, members){
+		m.device->pause_capture();
+		m.device->reset_capture();
+	}
+	
+	// Start the members back to back, and use the host clock to estimate
+	// how many samples late each one started relative to the first.
+	using namespace boost::posix_time;
+	ptime t0;
+	std::vector<int> offsets;
+	
+	for (unsigned i=0; i<members.size(); i++){
+		ptime before = microsec_clock::universal_time();
+		members[i].device->start_capture();
+		ptime after = microsec_clock::universal_time();
+		
+		ptime started = before + (after - before)/2;
+		if (i == 0) t0 = started;
+		
+		double delay = (started - t0).total_microseconds() / 1e6;
+		offsets.push_back(round(delay / sampleTime));
+	}
+	
+	boost::mutex::scoped_lock lock(link->mutex);
+	for (unsigned i=0; i<members.size(); i++){
+		members[i].offset = offsets[i];
+	}
+	captureState = true;
+}
+
+void DeviceGroup::pause_capture(){
+	prune();
+	BOOST_FOREACH(GroupMember& m, members){
+		m.device->pause_capture();
+	}
+	captureState = false;
+}
+
+unsigned DeviceGroup::available(){
+	if (members.empty()) return 0;
+	
+	int avail = members[0].device->capture_i + members[0].offset;
+	BOOST_FOREACH(GroupMember& m, members){
+		int a = m.device->capture_i + m.offset;
+		if (a < avail) avail = a;
+	}
+	return avail;
+}
+
+JSONNode DeviceGroup::toJSON(){
+	JSONNode n(JSON_NODE);
+	n.push_back(JSONNode("_action", "groupConfig"));
+	n.push_back(JSONNode("captureState", captureState));
+	
+	JSONNode j_devices(JSON_ARRAY);
+	j_devices.set_name("devices");
+	BOOST_FOREACH(GroupMember& m, members){
+		JSONNode d(JSON_NODE);
+		d.push_back(JSONNode("id", m.device->getId()));
+		d.push_back(JSONNode("offset", m.offset));
+		d.push_back(JSONNode("sampleTime", m.device->sampleTime));
+		j_devices.push_back(d);
+	}
+	n.push_back(j_devices);
+	return n;
+}
+
+void DeviceGroup::addListener(listener_ptr l){
+	cancelListen(l->id);
+	listeners[l->id] = l;
+	BOOST_FOREACH(GroupMember& m, members){
+		m.device->addListener(l);
+	}
+}
+
+void DeviceGroup::cancelListen(unsigned id){
+	std::map<unsigned, listener_ptr>::iterator it = listeners.find(id);
+	if (it == listeners.end()) return;
+	
+	BOOST_FOREACH(GroupMember& m, members){
+		m.device->cancelListen(it->second);
+	}
+	listeners.erase(it);
+}
+
+void DeviceGroup::clearAllListeners(){
+	while (!listeners.empty()){
+		cancelListen(listeners.begin()->first);
+	}
+}
+
+listener_ptr makeGroupListener(DeviceGroup* group, ClientConn* client, JSONNode &n){
+	std::auto_ptr<GroupListener> listener(new GroupListener(group->link));
+	
+	listener->id = jsonIntProp(n, "id");
+	listener->client = client;
+	listener->device = group->members[0].device.get();
+	
+	listener->decimateFactor = jsonIntProp(n, "decimateFactor", 1);
+	if (listener->decimateFactor == 0) listener->decimateFactor = 1;
+	
+	int start = jsonIntProp(n, "start", -1);
+	if (start < 0){ // Negative indexes are relative to latest sample
+		start = group->available() + start + 1;
+	}
+	listener->index = (start < 0) ? 0 : start;
+	
+	listener->count = jsonIntProp(n, "count");
+	
+	JSONNode j_streams = n.at("streams");
+	for(JSONNode::iterator i=j_streams.begin(); i!=j_streams.end(); i++){
+		GroupMember* m = group->memberById(jsonStringProp(*i, "device"));
+		if (!m) throw ErrorStringException("Device is not in group");
+		
+		listener->streams.push_back(
+			m->device->findStream(
+				jsonStringProp(*i, "channel"),
+				jsonStringProp(*i, "stream")));
+		listener->streamDevices.push_back(m->device.get());
+		listener->streamOffsets.push_back(m->offset);
+	}
+	
+	return listener_ptr(listener.release());
+}
+
+/// Called by each member device as its data arrives; sends the samples that
+/// every member has collected. Other members' capture counters and stream data
+/// are read without their stateMutex. That is safe because a member calls
+/// streamsChanging, which waits for link->mutex, before it resets or
+/// reallocates them.
+bool GroupListener::handleNewData(){
+	boost::mutex::scoped_lock lock(link->mutex);
+	
+	DeviceGroup* group = link->group;
+	if (!group) return false; // the client has gone
+	if (stale) return false;
+	
+	if (count > 0 && (int) outIndex >= count) return false;
+	
+	unsigned avail = group->available();
+	if (index + decimateFactor > avail) return true;
+	
+	unsigned nchunks = (avail - index)/decimateFactor;
+	if (count > 0 && (count - outIndex) < nchunks)
+		nchunks = count - outIndex;
+	
+	JSONArenaScope arena;
+	JSONNode n(JSON_NODE);
+	n.push_back(JSONNode("_action", "groupUpdate"));
+	n.push_back(JSONNode("id", id));
+	n.push_back(JSONNode("idx", outIndex));
+	if (outIndex == 0){
+		n.push_back(JSONNode("sampleIndex", index));
+	}
+	
+	JSONNode streams_data(JSON_ARRAY);
+	streams_data.set_name("data");
+	
+	for (unsigned s=0; s<streams.size(); s++){
+		JSONNode a(JSON_ARRAY);
+		
+		for (unsigned chunk = 0; chunk < nchunks; chunk++){
+			int i = (int) (index + chunk*decimateFactor) - streamOffsets[s];
+			float v = (i < 0) ? NAN : streamDevices[s]->resample(*streams[s], i, decimateFactor);
+			a.push_back(JSONNode("", v));
+		}
+		
+		streams_data.push_back(a);
+	}
+	n.push_back(streams_data);
+	
+	index += nchunks * decimateFactor;
+	outIndex += nchunks;
+	
+	bool done = (count>0 && (int) outIndex >= count);
+	if (done) n.push_back(JSONNode("done", true));
+	
+	client->sendJSON(n);
+	return !done;
+}
+
+/// Runs on the changing member's thread with its stateMutex held. Taking
+/// link->mutex waits out any other member's handleNewData that is reading it.
+void GroupListener::streamsChanging(){
+	boost::mutex::scoped_lock lock(link->mutex);
+	stale = true;
+}
+
+bool DeviceGroup::processMessage(ClientConn& client, string& cmd, JSONNode& n){
+	if (cmd == "groupSetDevices"){
+		std::vector<string> ids;
+		JSONNode j_devices = n.at("devices");
+		for(JSONNode::iterator i=j_devices.begin(); i!=j_devices.end(); i++){
+			ids.push_back(i->as_string());
+		}
+		setDevices(ids);
+	
+	}else if (cmd == "groupStartCapture"){
+		start_capture();
+	
+	}else if (cmd == "groupPauseCapture"){
+		pause_capture();
+	
+	}else if (cmd == "groupListen"){
+		prune();
+		if (members.empty()) throw ErrorStringException("Device group is empty");
+		addListener(makeGroupListener(this, &client, n));
+		return true;
+	
+	}else if (cmd == "groupCancelListen"){
+		cancelListen(jsonIntProp(n, "id"));
+		return true;
+	
+	}else{
+		return false;
+	}
+	
+	JSONNode reply = toJSON();
+	client.sendJSON(reply);
+	return true;
+}
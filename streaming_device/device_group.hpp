@@ -0,0 +1,100 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Synchronized capture across multiple streaming devices
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include "streaming_device.hpp"
+#include "stream_listener.hpp"
+
+typedef boost::shared_ptr<StreamingDevice> streaming_device_ptr;
+
+struct GroupMember{
+	GroupMember(streaming_device_ptr d): device(d), offset(0){}
+	
+	streaming_device_ptr device;
+	
+	/// Group sample index of this device's sample 0
+	int offset;
+};
+
+struct DeviceGroup;
+
+/// Shared by a group and its listeners, which run on the members' ingest
+/// threads and can still be queued on a device after the group is gone.
+/// `group` is cleared when the group is destroyed. The listeners only touch
+/// the group while holding `mutex`, and the group holds it to change members.
+struct GroupLink{
+	GroupLink(DeviceGroup* g): group(g){}
+	
+	boost::mutex mutex;
+	DeviceGroup* group;
+};
+
+typedef boost::shared_ptr<GroupLink> group_link_ptr;
+
+/// A set of streaming devices that start and stop capture together. Group
+/// sample index g is sample g - offset of each member, with the offsets
+/// measured against the host clock when capture is started.
+struct DeviceGroup{
+	DeviceGroup(): captureState(false), link(new GroupLink(this)){}
+	~DeviceGroup();
+	
+	/// Changed on the main thread under link->mutex
+	std::vector<GroupMember> members;
+	
+	bool captureState;
+	
+	void setDevices(const std::vector<string>& ids);
+	void start_capture();
+	void pause_capture();
+	
+	/// Number of group samples collected by every member
+	unsigned available();
+	
+	GroupMember* memberById(const string& id);
+	
+	JSONNode toJSON();
+	
+	bool processMessage(ClientConn& client, string& cmd, JSONNode& n);
+	
+	void addListener(listener_ptr l);
+	void cancelListen(unsigned id);
+	void clearAllListeners();
+	
+	std::map<unsigned, listener_ptr> listeners;
+	
+	group_link_ptr link;
+	
+	private:
+		/// Drop members that have been disconnected, and the listeners that
+		/// read from them
+		void prune();
+};
+
+/// Members call handleNewData from their own ingest threads. The group is a
+/// member of the client's connection, so the client is alive while the link
+/// still points at the group.
+struct GroupListener: public StreamListener{
+	GroupListener(group_link_ptr l): link(l), stale(false){}
+	
+	group_link_ptr link;
+	ClientConn* client;
+	
+	/// Set under link->mutex when any member is about to reset or reallocate
+	/// its streams. The listener then ends on every member.
+	bool stale;
+	
+	/// Device and group offset of each entry of streams
+	std::vector<StreamingDevice*> streamDevices;
+	std::vector<int> streamOffsets;
+	
+	// Not matched by isFromClient: group listener ids are separate from the
+	// client's per-device listeners, and the group removes them itself.
+	virtual bool handleNewData();
+	virtual void streamsChanging();
+};
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <boost/foreach.hpp>
 
 using std::vector;
@@ -156,9 +157,12 @@ struct SquareWaveSource: public PeriodicSource{
 	}
 };
 
+/// Longest period for which arb waves are expanded into a per-sample table
+const unsigned ARB_DENSE_MAX_PERIOD = 1<<16;
+
 struct ArbitraryWaveformSource: public OutputSource{
 	ArbitraryWaveformSource(unsigned m, int phase_, ArbWavePoint_vec& values_, int repeat_count_):
-		OutputSource(m), phase(phase_), values(values_), index(0), repeat_count(repeat_count_){
+		OutputSource(m), phase(phase_), startTime(0), values(values_), repeat_count(repeat_count_), index(0){
 			if (repeat_count == 0) repeat_count = 1;
 
 			if (values.size() < 1) throw ErrorStringException("Arb wave must have at least one point.");
@@ -183,8 +187,8 @@ struct ArbitraryWaveformSource: public OutputSource{
 	}
 	
 	virtual float getValue(unsigned sample, double sampleTime){
-		unsigned length = values.size();
-
+		unsigned per = period();
+		
 		if (sample < startTime){
 			sample = 0;
 		}else{
@@ -192,50 +196,62 @@ struct ArbitraryWaveformSource: public OutputSource{
 			sample -= startTime;
 		}
 		
-		unsigned time1, time2;
-		float value1, value2;
+		if (per == 0) return values.back().v;
 		
-		while(1){
-			time1  = values[index].t;
-			value1 = values[index].v;
-			
-			unsigned nextIndex = index+1;
-			
-			if (nextIndex >= length){
-				// repeat == -1 means infinite
-				if (repeat_count>1 || repeat_count==-1){
-					if (repeat_count>0) repeat_count--;
-					index = 0;
-					startTime += time1;
-					sample -= time1;
-					continue;
-				}else{
-					// If repeat is disabled, the last value remains forever
-					return value1;
-				}
-			}
+		// repeat == -1 means infinite
+		if (repeat_count == -1 || (repeat_count > 1 && sample / per < (unsigned) repeat_count)){
+			sample %= per;
+		}else if (sample >= per){
+			// If repeat is disabled, the last value remains forever
+			return values.back().v;
+		}
 		
-			time2  = values[nextIndex].t;
-			value2 = values[nextIndex].v;
-			
-			if (sample >= time2){
-				// When we pass the next point, move forward in the list
-				index = nextIndex;
-				continue;
+		if (!table.empty()) return table[sample];
+		
+		// Samples arrive in order, so the segment is usually the current or next one
+		unsigned nseg = segStart.size();
+		if (sample < segStart[index] || (index+1 < nseg && sample >= segStart[index+1])){
+			if (index+1 < nseg && sample >= segStart[index+1] && (index+2 >= nseg || sample < segStart[index+2])){
+				index++;
 			}else{
-				break;
+				index = std::upper_bound(segStart.begin(), segStart.end(), sample) - segStart.begin() - 1;
 			}
 		}
 		
-		// For the first point
-		if (sample < time1) return value1;
+		return segValue[index] + (sample - segStart[index]) * segSlope[index];
+	}
+	
+	/// Build the lookup used by getValue: a table of every sample for short
+	/// periods, or the slope and intercept of each segment for long ones.
+	void compile(){
+		table.clear();
+		segStart.clear();
+		segValue.clear();
+		segSlope.clear();
+		index = 0;
+		
+		unsigned per = period();
+		if (per == 0) return;
 		
-		// Proportion of the time between the last point and the next point
-		double p = (((double)sample) - time1)/(((double)time2) - time1);
-		//std::cout << sample << " time1=" << time1 << " time2=" << time2 << " val1=" << value1 << " val2="<<value2 << " p=" <<p<<" val="<<(1-p) * value1 + p*value2<<std::endl;
+		for (unsigned i=0; i+1<values.size(); i++){
+			unsigned t1 = values[i].t, t2 = values[i+1].t;
+			
+			// Points at the same time are a step; the later one wins
+			if (t2 == t1) continue;
+			
+			segStart.push_back(t1);
+			segValue.push_back(values[i].v);
+			segSlope.push_back((values[i+1].v - (double) values[i].v) / (t2 - t1));
+		}
 		
-		// Trapezoidal interpolation
-		return (1-p) * value1 + p*value2;
+		if (per <= ARB_DENSE_MAX_PERIOD){
+			table.resize(per);
+			unsigned seg = 0;
+			for (unsigned t=0; t<per; t++){
+				while (seg+1 < segStart.size() && t >= segStart[seg+1]) seg++;
+				table[t] = segValue[seg] + (t - segStart[seg]) * segSlope[seg];
+			}
+		}
 	}
 	
 	virtual void describeJSON(JSONNode &n){
@@ -265,6 +281,8 @@ struct ArbitraryWaveformSource: public OutputSource{
 		}else{
 			startTime = phase;
 		}
+		
+		compile();
 	}
 
 	virtual double getPhaseZeroAfterSample(unsigned sample){
@@ -276,10 +294,217 @@ struct ArbitraryWaveformSource: public OutputSource{
 	int phase;
 	unsigned startTime;
 	ArbWavePoint_vec values;
-	unsigned index;
 	int repeat_count;
+	
+	/// Per-sample values, if the period is short enough
+	vector<float> table;
+	
+	/// Start time, value at start and slope of each non-empty segment
+	vector<unsigned> segStart;
+	vector<float> segValue;
+	vector<double> segSlope;
+	
+	/// Segment used by the last getValue
+	unsigned index;
+};
+
+enum FeedbackLaw {FEEDBACK_PID=0, // PID controller on (setpoint - input)
+                  FEEDBACK_LOOKUP // Piecewise-linear function of the input
 };
 
+typedef vector<pair<float, float> > FeedbackLookup_vec;
+
+/// Closed-loop source: computes its output from the most recent samples of
+/// an input stream once per IN transfer, so the loop runs at USB latency.
+struct FeedbackSource: public OutputSource{
+	FeedbackSource(unsigned m, Stream* input_, const string& inputChannel_, FeedbackLaw law_, unsigned average_, float offset_, float min_, float max_):
+		OutputSource(m), input(input_), inputChannel(inputChannel_), law(law_), average(average_),
+		setpoint(0), kp(0), ki(0), kd(0), offset(offset_), min(min_), max(max_),
+		integral(0), lastError(0), lastSample(0), primed(false){
+			if (average == 0) average = 1;
+			if (min > max) throw ErrorStringException("Feedback min must not be greater than max.");
+			value = constrain(offset);
+		}
+	
+	virtual string displayName(){return "feedback";}
+	
+	virtual float getValue(unsigned sample, double sampleTime){ return value; }
+	
+	inline float constrain(float v){
+		if (v > max) return max;
+		if (v < min) return min;
+		return v;
+	}
+	
+	float lookup(float in){
+		if (in <= table[0].first) return table[0].second;
+		for (unsigned i=1; i<table.size(); i++){
+			if (in < table[i].first){
+				float p = (in - table[i-1].first)/(table[i].first - table[i-1].first);
+				return (1-p) * table[i-1].second + p * table[i].second;
+			}
+		}
+		return table[table.size()-1].second;
+	}
+	
+	virtual void handleNewData(StreamingDevice* dev){
+		unsigned end = dev->capture_i;
+		if (end == lastSample || end < average) return;
+		if (end < lastSample) primed = false; // capture was reset
+		
+		float measured = dev->resample(*input, end - average, average);
+		if (std::isnan(measured)) return;
+		
+		if (law == FEEDBACK_LOOKUP){
+			value = constrain(lookup(measured));
+		}else{
+			double error = setpoint - measured;
+			double dt = (end - lastSample) * dev->sampleTime;
+			double newIntegral = integral;
+			double derivative = 0;
+			
+			if (primed){
+				newIntegral += error * dt;
+				derivative = (error - lastError) / dt;
+			}
+			
+			double out = offset + kp*error + ki*newIntegral + kd*derivative;
+			
+			// Only accumulate the integral while unsaturated to prevent windup
+			if (out >= min && out <= max) integral = newIntegral;
+			
+			value = constrain(out);
+			lastError = error;
+			primed = true;
+		}
+		
+		lastSample = end;
+	}
+	
+	virtual void initialize(unsigned sample, OutputSource* prevSrc){
+		// Start from the previous output value for a bumpless transfer
+		if (!prevSrc || prevSrc->mode != mode || law != FEEDBACK_PID || ki == 0) return;
+		
+		float prev;
+		if (ConstantSource* c = dynamic_cast<ConstantSource*>(prevSrc)){
+			prev = c->value;
+		}else if (FeedbackSource* f = dynamic_cast<FeedbackSource*>(prevSrc)){
+			prev = f->value;
+		}else return;
+		
+		integral = (constrain(prev) - offset) / ki;
+		value = constrain(prev);
+	}
+	
+	virtual void describeJSON(JSONNode &n){
+		OutputSource::describeJSON(n);
+		n.push_back(JSONNode("law", (law == FEEDBACK_LOOKUP)?"lookup":"pid"));
+		
+		JSONNode j_input(JSON_NODE);
+		j_input.set_name("input");
+		j_input.push_back(JSONNode("channel", inputChannel));
+		j_input.push_back(JSONNode("stream", input->id));
+		n.push_back(j_input);
+		
+		n.push_back(JSONNode("average", average));
+		if (std::isfinite(min)) n.push_back(JSONNode("min", min));
+		if (std::isfinite(max)) n.push_back(JSONNode("max", max));
+		
+		if (law == FEEDBACK_LOOKUP){
+			JSONNode points = JSONNode(JSON_ARRAY);
+			for (unsigned i=0; i<table.size(); i++){
+				JSONNode o;
+				o.push_back(JSONNode("in", table[i].first));
+				o.push_back(JSONNode("out", table[i].second));
+				points.push_back(o);
+			}
+			points.set_name("table");
+			n.push_back(points);
+		}else{
+			n.push_back(JSONNode("offset", offset));
+			n.push_back(JSONNode("setpoint", setpoint));
+			n.push_back(JSONNode("kp", kp));
+			n.push_back(JSONNode("ki", ki));
+			n.push_back(JSONNode("kd", kd));
+		}
+	}
+	
+	virtual void statusJSON(JSONNode &n){
+		n.push_back(JSONNode("value", value));
+	}
+	
+	Stream* input;
+	string inputChannel;
+	FeedbackLaw law;
+	unsigned average;
+	
+	/// PID law only; offset is the output at zero error
+	float setpoint, kp, ki, kd;
+	float offset;
+	
+	float min, max;
+	FeedbackLookup_vec table;
+	
+	/// Output value, written by handleNewData on the ingest thread under
+	/// stateMutex and read by getValue on the USB thread
+	volatile float value;
+	
+	double integral;
+	double lastError;
+	unsigned lastSample;
+	bool primed;
+};
+
+/// Round a requested size up to a power of two
+static unsigned bufferedSourceSize(unsigned size){
+	if (size == 0) throw ErrorStringException("Buffered source must have nonzero size.");
+	if (size > BUFFERED_SOURCE_MAX_SIZE) throw ErrorStringException("Buffered source size is too large.");
+	unsigned n = 1;
+	while (n < size) n <<= 1;
+	return n;
+}
+
+BufferedSource::BufferedSource(unsigned m, unsigned size, float initial):
+	OutputSource(m), buffer(bufferedSourceSize(size)), mask(buffer.size()-1),
+	head(0), tail(0), underruns(0), lastValue(initial){}
+
+/// Runs in USB thread
+float BufferedSource::getValue(unsigned sample, double sampleTime){
+	if (tail != head){
+		__sync_synchronize(); // see the samples published before head
+		lastValue = buffer[tail & mask];
+		__sync_synchronize(); // finish reading the slot before releasing it
+		tail++;
+	}else{
+		underruns++;
+	}
+	return lastValue;
+}
+
+unsigned BufferedSource::append(const float* values, unsigned count){
+	unsigned space = buffer.size() - fill();
+	if (count > space) count = space;
+	
+	for (unsigned i=0; i<count; i++){
+		buffer[(head + i) & mask] = values[i];
+	}
+	
+	__sync_synchronize(); // publish the samples before advancing head
+	head += count;
+	return count;
+}
+
+void BufferedSource::statusJSON(JSONNode &n){
+	n.push_back(JSONNode("value", lastValue));
+	n.push_back(JSONNode("fill", fill()));
+	n.push_back(JSONNode("underruns", underruns));
+}
+
+void BufferedSource::describeJSON(JSONNode &n){
+	OutputSource::describeJSON(n);
+	n.push_back(JSONNode("bufferSize", size()));
+}
+
 OutputSource* makeSource(unsigned mode, const string& source, float offset, float amplitude, double period, double phase, bool relPhase){
 	if (source == "sine")
 			return new SineWaveSource(mode, offset, amplitude, period, phase, relPhase);
@@ -298,7 +523,8 @@ OutputSource* makeArbitraryWaveform(unsigned mode, int phase, ArbWavePoint_vec&
 	return new ArbitraryWaveformSource(mode, phase, values, repeat_count);
 }
 
-OutputSource* makeSource(JSONNode& n){
+template <class Node>
+OutputSource* makeSource(Node& n, StreamingDevice* dev){
 	string source = jsonStringProp(n, "source", "constant");
 	unsigned mode = jsonFloatProp(n, "mode", 0); //TODO: validate
 	string hint = jsonStringProp(n, "hint", "");
@@ -331,14 +557,61 @@ OutputSource* makeSource(JSONNode& n){
 		unsigned repeat = jsonIntProp(n, "repeat", 0);
 		
 		ArbWavePoint_vec values;
-		JSONNode j_values = n.at("values");
-		for(JSONNode::iterator i=j_values.begin(); i!=j_values.end(); i++){
+		Node j_values = n.at("values");
+		for(typename Node::iterator i=j_values.begin(); i!=j_values.end(); i++){
 			values.push_back(ArbWavePoint(
 					jsonIntProp(*i, "t"),
 					jsonFloatProp(*i, "v")));
 		}
 		
 		r = makeArbitraryWaveform(mode, phase, values, repeat);
+		
+	}else if (source == "buffered"){
+		unsigned size = jsonIntProp(n, "bufferSize", 1<<16);
+		float initial = jsonFloatProp(n, "value", 0);
+		r = new BufferedSource(mode, size, initial);
+		
+	}else if (source == "feedback"){
+		if (!dev) throw ErrorStringException("Feedback source requires a device");
+		
+		Node j_input = n.at("input");
+		string inputChannel = jsonStringProp(j_input, "channel");
+		Stream* input = dev->findStream(inputChannel, jsonStringProp(j_input, "stream"));
+		
+		string law = jsonStringProp(n, "law", "pid");
+		unsigned average = jsonIntProp(n, "average", 1);
+		float min = jsonFloatProp(n, "min", -INFINITY);
+		float max = jsonFloatProp(n, "max", INFINITY);
+		
+		FeedbackSource* f;
+		
+		if (law == "pid"){
+			float offset = jsonFloatProp(n, "offset", 0);
+			f = new FeedbackSource(mode, input, inputChannel, FEEDBACK_PID, average, offset, min, max);
+			f->setpoint = jsonFloatProp(n, "setpoint");
+			f->kp = jsonFloatProp(n, "kp", 0);
+			f->ki = jsonFloatProp(n, "ki", 0);
+			f->kd = jsonFloatProp(n, "kd", 0);
+			
+		}else if (law == "lookup"){
+			FeedbackLookup_vec table;
+			Node j_table = n.at("table");
+			for(typename Node::iterator i=j_table.begin(); i!=j_table.end(); i++){
+				float in = jsonFloatProp(*i, "in");
+				if (table.size() && in < table.back().first)
+					throw ErrorStringException("Feedback table must be in input order.");
+				table.push_back(pair<float, float>(in, jsonFloatProp(*i, "out")));
+			}
+			if (table.size() < 1) throw ErrorStringException("Feedback table must have at least one point.");
+			
+			f = new FeedbackSource(mode, input, inputChannel, FEEDBACK_LOOKUP, average, 0, min, max);
+			f->table = table;
+			
+		}else{
+			throw ErrorStringException("Invalid feedback law");
+		}
+		
+		r = f;
 	}else{
 		throw ErrorStringException("Invalid source");
 	}
@@ -346,3 +619,6 @@ OutputSource* makeSource(JSONNode& n){
 	r->hint = hint;
 	return r;
 }
+
+template OutputSource* makeSource(JSONNode& n, StreamingDevice* dev);
+template OutputSource* makeSource(JSONViewNode& n, StreamingDevice* dev);
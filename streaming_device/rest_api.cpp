@@ -12,6 +12,7 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <sstream>
+#include <ctime>
 #include <boost/foreach.hpp>
 
 //// device/channel/output resource
@@ -19,14 +20,16 @@
 void StreamingDevice::RESTOutputRespond(websocketpp::session_ptr client, Channel *channel){
 	JSONNode n;
 	channel->source->describeJSON(n);
+	channel->source->statusJSON(n);
 	respondJSON(client, n);
 }
 
 void StreamingDevice::handleRESTOutputCallback(websocketpp::session_ptr client, Channel* channel, string postdata){
+	state_lock lock(stateMutex);
 	try{
 		if (postdata[0] == '{'){
 			JSONNode n = libjson::parse(postdata);
-			setOutput(channel, makeSource(n));
+			setOutput(channel, makeSource(n, this));
 		}else{
 			std::map<string, string> map;
 			parse_query(postdata, map);
@@ -155,12 +158,17 @@ struct RESTListener: public StreamListener{
 		index += nchunks * decimateFactor;
 		outIndex += nchunks;
 		
-		client->http_write(o.str());
+		io.post(boost::bind(&RESTListener::write, client, o.str(), false));
 		return !(count>0 && (int) outIndex >= count);
 	}
 	
+	/// Runs in the main thread, as the session is not thread-safe
+	static void write(websocketpp::session_ptr client, string data, bool done){
+		if (!client->is_closed()) client->http_write(data, done);
+	}
+	
 	virtual ~RESTListener(){
-		if (client && !client->is_closed()) client->http_write("", true);
+		if (client) io.post(boost::bind(&RESTListener::write, client, string(), true));
 	}
 };
 
@@ -178,21 +186,21 @@ bool StreamingDevice::handleRESTInput(UrlPath path, websocketpp::session_ptr cli
 		l->device = this;
 		l->streams = channel->streams;
 	
-		float resample_s = boost::lexical_cast<float>(path.param("resample", "0.01"));
+		float resample_s = path.param_num<float>("resample", 0.01);
 		l->decimateFactor = round(resample_s / sampleTime);
 	
 		// Prevent divide by 0
 		if (l->decimateFactor == 0) l->decimateFactor = 1;
 
-		int start = boost::lexical_cast<int>(path.param("start", "-1"));
+		int start = path.param_num<int>("start", -1);
 		if (start < 0){ // Negative indexes are relative to latest sample
 			start = (buffer_max()) + start + 1;
 		}
 		if (start < 0) l->index = 0;
 		else l->index = start;
 	
-		l->count = boost::lexical_cast<unsigned>(path.param("count", "1"));
-		bool header = (path.param("header", "1") == "1");
+		l->count = path.param_num<int>("count", 1); // 0 or negative for no limit
+		bool header = path.param_is("header", "1", true);
 	
 		std::ostringstream o(std::ostringstream::out);
 	
@@ -215,6 +223,7 @@ bool StreamingDevice::handleRESTInput(UrlPath path, websocketpp::session_ptr cli
 }
 
 void StreamingDevice::handleRESTInputPOSTCallback(websocketpp::session_ptr client, Channel* channel, string postdata){
+	state_lock lock(stateMutex);
 	try{
 		std::map<string, string> map;
 		parse_query(postdata, map);
@@ -237,14 +246,43 @@ void StreamingDevice::handleRESTInputPOSTCallback(websocketpp::session_ptr clien
 	}
 }
 
+//// Response cache
+
+/// Distinguishes ETags from a previous run, whose stateVersions restarted at 0
+static const unsigned long restEtagEpoch = time(0);
+
+/// Respond from the cached body if the state hasn't changed since it was built,
+/// or with 304 if the client already has this version. The body must not
+/// include live output status, which changes without bumping stateVersion.
+void StreamingDevice::respondRESTCached(websocketpp::session_ptr client, const string& key, boost::function<JSONNode()> build){
+	unsigned version = stateVersion;
+	RESTCacheEntry& entry = restCache[key];
+	
+	if (entry.body.empty() || entry.version != version){
+		JSONNode n = build();
+		entry.body = n.write_formatted();
+		entry.version = version;
+	}
+	
+	std::ostringstream etag;
+	etag << '"' << std::hex << restEtagEpoch << '-' << version << '"';
+	client->set_header("ETag", etag.str());
+	
+	if (client->get_client_header("If-None-Match") == etag.str()){
+		client->start_http(304);
+	}else{
+		client->start_http(200, entry.body);
+	}
+}
+
 /// Device resource
 
 void StreamingDevice::RESTDeviceRespond(websocketpp::session_ptr client){
-	JSONNode jstate = stateToJSON();
-	respondJSON(client, jstate);
+	respondRESTCached(client, "device", boost::bind(&StreamingDevice::stateToJSON, this, false, false));
 }
 
 void StreamingDevice::handleRESTDeviceCallback(websocketpp::session_ptr client, string postdata){
+	state_lock lock(stateMutex);
 	try{
 		if (postdata[0] == '{'){
 			//TODO: json
@@ -266,21 +304,14 @@ void StreamingDevice::handleRESTDeviceCallback(websocketpp::session_ptr client,
 	}
 }
 
-/// Channel resource
-
-void handleRESTChannel(websocketpp::session_ptr client, Channel* channel){
-	JSONNode n = channel->toJSON();
-	respondJSON(client, n);
-}
-
 /// Configuration resource
 
 void StreamingDevice::RESTConfigurationRespond(websocketpp::session_ptr client){
-	JSONNode jstate = stateToJSON(true);
-	respondJSON(client, jstate);
+	respondRESTCached(client, "configuration", boost::bind(&StreamingDevice::stateToJSON, this, true, false));
 }
 
 void StreamingDevice::handleRESTConfigurationCallback(websocketpp::session_ptr client, string postdata){
+	state_lock lock(stateMutex);
 	try{
 		if (postdata[0] == '{'){
 			//TODO: json
@@ -309,6 +340,7 @@ void StreamingDevice::handleRESTConfigurationCallback(websocketpp::session_ptr c
 /// Dispatch
 
 bool StreamingDevice::handleREST(UrlPath path, websocketpp::session_ptr client){
+	state_lock lock(stateMutex);
 	if (path.leaf()){
 		if (client->get_method() == "POST"){
 			client->read_http_post_body(
@@ -338,8 +370,8 @@ bool StreamingDevice::handleREST(UrlPath path, websocketpp::session_ptr client){
 			if (!channel) return false;
 		
 			UrlPath spath = path.sub();
-			if (spath.leaf()){
-				handleRESTChannel(client, channel);
+			if (spath.leaf()){ // Channel resource
+				respondRESTCached(client, "channel/" + channel->id, boost::bind(&Channel::toJSON, channel, false));
 				return true;
 			};
 		
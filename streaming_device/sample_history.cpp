@@ -0,0 +1,115 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Compressed sample history for compact streams
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#include "streaming_device.hpp"
+
+static inline uint32_t zigzag(int32_t v){
+	return ((uint32_t) v << 1) ^ (v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v){
+	return (v >> 1) ^ -(int32_t)(v & 1);
+}
+
+SampleHistory::SampleHistory(size_t maxBytes_): totalBytes(0), maxBytes(maxBytes_), useCounter(0){
+	for (unsigned i=0; i<HISTORY_CACHE_BLOCKS; i++) cache[i].valid = false;
+}
+
+void SampleHistory::append(unsigned start, const int16_t* codes){
+	blocks.push_back(HistoryBlock());
+	HistoryBlock& b = blocks.back();
+	b.start = start;
+	b.first = codes[0];
+	b.sum = 0;
+	b.nonzero = 0;
+	b.min = INT16_MAX;
+	b.max = INT16_MIN;
+	
+	uint32_t deltas[HISTORY_BLOCK_SAMPLES];
+	uint32_t all = 0;
+	for (unsigned i=0; i<HISTORY_BLOCK_SAMPLES; i++){
+		int16_t c = codes[i];
+		if (c != STREAM_CODE_ZERO){
+			b.sum += c;
+			b.nonzero++;
+			if (c < b.min) b.min = c;
+			if (c > b.max) b.max = c;
+		}
+		if (i){
+			deltas[i] = zigzag((int32_t) c - codes[i-1]);
+			all |= deltas[i];
+		}
+	}
+	
+	b.bits = 0;
+	while (b.bits < 32 && (all >> b.bits)) b.bits++;
+	
+	// 8 bytes of padding let the decoder read whole words past the end
+	b.packed.assign(((HISTORY_BLOCK_SAMPLES-1)*b.bits + 7)/8 + 8, 0);
+	uint64_t acc = 0;
+	unsigned accBits = 0, pos = 0;
+	for (unsigned i=1; i<HISTORY_BLOCK_SAMPLES; i++){
+		acc |= (uint64_t) deltas[i] << accBits;
+		accBits += b.bits;
+		while (accBits >= 8){
+			b.packed[pos++] = acc & 0xff;
+			acc >>= 8;
+			accBits -= 8;
+		}
+	}
+	if (accBits) b.packed[pos++] = acc & 0xff;
+	
+	totalBytes += b.packed.size() + sizeof(HistoryBlock);
+	
+	while (totalBytes > maxBytes && blocks.size() > 1){
+		totalBytes -= blocks.front().packed.size() + sizeof(HistoryBlock);
+		blocks.pop_front();
+	}
+}
+
+void SampleHistory::clear(){
+	blocks.clear();
+	totalBytes = 0;
+	for (unsigned i=0; i<HISTORY_CACHE_BLOCKS; i++) cache[i].valid = false;
+}
+
+const int16_t* SampleHistory::decode(const HistoryBlock& b){
+	CacheEntry* victim = &cache[0];
+	for (unsigned i=0; i<HISTORY_CACHE_BLOCKS; i++){
+		CacheEntry& e = cache[i];
+		if (e.valid && e.start == b.start){
+			e.lastUse = ++useCounter;
+			return e.codes;
+		}
+		if (!e.valid || e.lastUse < victim->lastUse) victim = &e;
+	}
+	
+	int16_t* out = victim->codes;
+	out[0] = b.first;
+	const uint8_t* p = &b.packed[0];
+	uint64_t mask = (b.bits < 64) ? ((uint64_t) 1 << b.bits) - 1 : ~(uint64_t) 0;
+	unsigned bitPos = 0;
+	for (unsigned i=1; i<HISTORY_BLOCK_SAMPLES; i++){
+		uint64_t word = 0;
+		const uint8_t* w = p + bitPos/8;
+		for (unsigned k=0; k<8; k++) word |= (uint64_t) w[k] << (8*k);
+		uint32_t zz = (word >> (bitPos & 7)) & mask;
+		bitPos += b.bits;
+		out[i] = out[i-1] + unzigzag(zz);
+	}
+	
+	victim->valid = true;
+	victim->start = b.start;
+	victim->lastUse = ++useCounter;
+	return out;
+}
+
+int16_t SampleHistory::get(unsigned i){
+	const HistoryBlock& b = blockAt(i);
+	return decode(b)[i - b.start];
+}
@@ -0,0 +1,82 @@
+// Nonolith Connect
+// https://github.com/nonolith/connect
+// Compressed sample history for compact streams
+// Released under the terms of the GNU GPLv3+
+// (C) 2012 Nonolith Labs, LLC
+// Authors:
+//   Kevin Mehall <km@kevinmehall.net>
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+const unsigned HISTORY_BLOCK_SAMPLES = 1024;
+const unsigned HISTORY_CACHE_BLOCKS = 4;
+
+/// HISTORY_BLOCK_SAMPLES codes, stored as the first code followed by the
+/// zigzag-encoded deltas bit-packed at a fixed width. Slowly varying signals
+/// need only a few bits per sample.
+struct HistoryBlock{
+	unsigned start; // capture index of the first sample
+	int16_t first;
+	uint8_t bits;
+	
+	/// Summary of the codes that aren't STREAM_CODE_ZERO, so averages over
+	/// whole blocks don't need to decompress them
+	int32_t sum;
+	uint16_t nonzero;
+	int16_t min, max;
+	
+	std::vector<uint8_t> packed;
+};
+
+/// Older samples of a compact stream, kept in compressed blocks after the
+/// capture ring has overwritten them. Holds as many of the most recent blocks
+/// as fit in maxBytes. Guarded by the device's stateMutex.
+class SampleHistory{
+	public:
+		SampleHistory(size_t maxBytes_);
+		
+		/// Compress HISTORY_BLOCK_SAMPLES codes, which must continue from the
+		/// previous block unless the history is empty.
+		void append(unsigned start, const int16_t* codes);
+		
+		void clear();
+		
+		bool empty(){ return blocks.empty(); }
+		unsigned start(){ return blocks.front().start; }
+		unsigned end(){ return blocks.back().start + HISTORY_BLOCK_SAMPLES; }
+		bool contains(unsigned i){ return !empty() && i >= start() && i < end(); }
+		
+		/// The code at capture index i, which must be contained
+		int16_t get(unsigned i);
+		
+		/// The block containing capture index i, which must be contained
+		const HistoryBlock& blockAt(unsigned i){
+			return blocks[(i - start()) / HISTORY_BLOCK_SAMPLES];
+		}
+		
+		/// Compressed bytes, and the samples they hold
+		size_t bytes(){ return totalBytes; }
+		size_t samples(){ return blocks.size() * HISTORY_BLOCK_SAMPLES; }
+		
+	private:
+		std::deque<HistoryBlock> blocks;
+		size_t totalBytes;
+		size_t maxBytes;
+		
+		/// Recently decoded blocks, shared by all the listeners reading the stream
+		struct CacheEntry{
+			bool valid;
+			unsigned start;
+			unsigned lastUse;
+			int16_t codes[HISTORY_BLOCK_SAMPLES];
+		};
+		CacheEntry cache[HISTORY_CACHE_BLOCKS];
+		unsigned useCounter;
+		
+		const int16_t* decode(const HistoryBlock& b);
+};
@@ -24,9 +24,12 @@ StreamListener::StreamListener():
 	triggerOffset(0),
 	triggerForce(0),
 	triggerForceIndex(0),
-	triggerSubsampleError(0){}
+	triggerSubsampleError(0),
+	sendAge(false),
+	age(new MetricHistogram()){}
 
-listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONNode &n){
+template <class Node>
+listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, Node &n){
 	std::auto_ptr<WSStreamListener> listener(new WSStreamListener());
 
 	listener->id = jsonIntProp(n, "id");
@@ -47,18 +50,19 @@ listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONNo
 	else listener->index = start;
 	
 	listener->count = jsonIntProp(n, "count");
+	listener->sendAge = jsonBoolProp(n, "age", false);
 	
-	JSONNode j_streams = n.at("streams");
-	for(JSONNode::iterator i=j_streams.begin(); i!=j_streams.end(); i++){
+	Node j_streams = n.at("streams");
+	for(typename Node::iterator i=j_streams.begin(); i!=j_streams.end(); i++){
 		listener->streams.push_back(
 			dev->findStream(
 				jsonStringProp(*i, "channel"),
 				jsonStringProp(*i, "stream")));
 	}
 	
-	JSONNode::iterator t = n.find("trigger");
+	typename Node::iterator t = n.find("trigger");
 	if (t != n.end() && (t->type()) == JSON_NODE){
-		JSONNode &trigger = *t;
+		Node &trigger = *t;
 		
 		string type = jsonStringProp(trigger, "type", "in");
 		if (type == "in"){
@@ -91,6 +95,9 @@ listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONNo
 	return listener_ptr(listener.release());
 }
 
+template listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONNode &n);
+template listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONViewNode &n);
+
 unsigned StreamListener::howManySamples(){
 	if (triggerType != NONE && !triggered && !findTrigger())
 		// Waiting for a trigger and haven't found it yet
@@ -114,6 +121,7 @@ bool WSStreamListener::handleNewData(){
 	unsigned nchunks = howManySamples();
 	if (!nchunks) return true;
 	
+	JSONArenaScope arena;
 	JSONNode n(JSON_NODE);
 
 	n.push_back(JSONNode("id", id));
@@ -148,6 +156,11 @@ bool WSStreamListener::handleNewData(){
 	
 	index += nchunks * decimateFactor;
 	outIndex += nchunks;
+	
+	uint64_t stamp = device->sampleStamp(index - 1);
+	if (sendAge && stamp){
+		n.push_back(JSONNode("age", (monotonicMicros() - stamp) / 1e6));
+	}
 
 	bool done = (count>0 && (int) outIndex >= count);
 	
@@ -156,7 +169,7 @@ bool WSStreamListener::handleNewData(){
 	}
 
 	n.push_back(JSONNode("_action", "update"));
-	client->sendJSON(n);
+	client->sendJSON(n, stamp, age);
 	
 	if (done && triggerRepeat){
 		//std::cout << "Trigger sweep end "<<index<<" "<<outIndex<<std::endl;
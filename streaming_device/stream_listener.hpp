@@ -23,6 +23,9 @@ struct StreamListener{
 	unsigned id;
 	virtual bool isFromClient(ClientConn* c){return false;}
 	
+	/// The client whose id this is, for StreamingDevice's listener index
+	virtual ClientConn* getClient(){return 0;}
+	
 	StreamingDevice* device;
 	std::vector<Stream*> streams;
 
@@ -47,6 +50,13 @@ struct StreamListener{
 	unsigned triggerForce;
 	unsigned triggerForceIndex;
 	double triggerSubsampleError;
+	
+	/// Add the age of the newest sample, in seconds, to each update
+	bool sendAge;
+	
+	/// Time from USB completion to sending, of the newest sample of each
+	/// message. Shared with queued sends, which may outlive the listener.
+	boost::shared_ptr<MetricHistogram> age;
 
 	inline void reset(){
 		index = 0;
@@ -58,6 +68,10 @@ struct StreamListener{
 	// return true if listener is to be kept, false if it is to be destroyed
 	virtual bool handleNewData(){return false;}
 	
+	/// Called by a device, with its stateMutex held, before it resets or
+	/// reallocates its streams
+	virtual void streamsChanging(){}
+	
 	// return true if trigger was found
 	bool findTrigger();
 };
@@ -65,7 +79,8 @@ struct StreamListener{
 struct WSStreamListener: public StreamListener{
 	ClientConn* client;
 	virtual bool isFromClient(ClientConn* c){return c == client;}
+	virtual ClientConn* getClient(){return client;}
 	virtual bool handleNewData();
 };
 
-listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, JSONNode &n);
+template <class Node> listener_ptr makeStreamListener(StreamingDevice* dev, ClientConn* client, Node &n);
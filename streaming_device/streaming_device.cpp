@@ -8,6 +8,15 @@
 
 #include <iostream>
 #include <boost/foreach.hpp>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "streaming_device.hpp"
 #include "stream_listener.hpp"
@@ -29,7 +38,7 @@ JSONNode Stream::toJSON(){
 	return n;
 }
 
-JSONNode Channel::toJSON(){
+JSONNode Channel::toJSON(bool live){
 	Channel *channel = this;
 	JSONNode n(JSON_NODE);
 	n.set_name(channel->id);
@@ -40,6 +49,7 @@ JSONNode Channel::toJSON(){
 		JSONNode output(JSON_NODE);
 		output.set_name("output");
 		source->describeJSON(output);
+		if (live) source->statusJSON(output);
 		n.push_back(output);
 	}
 
@@ -53,7 +63,7 @@ JSONNode Channel::toJSON(){
 	return n;
 }
 
-JSONNode StreamingDevice::stateToJSON(bool configOnly){
+JSONNode StreamingDevice::stateToJSON(bool configOnly, bool live){
 	JSONNode n;
 	if (!configOnly){
 		n = toJSON();
@@ -67,6 +77,7 @@ JSONNode StreamingDevice::stateToJSON(bool configOnly){
 	n.push_back(JSONNode("continuous", captureContinuous));
 	n.push_back(JSONNode("raw", rawMode));
 	n.push_back(JSONNode("currentLimit", currentLimit));
+	n.push_back(JSONNode("allocTime", allocTime));
 	
 	if  (configOnly) return n;
 	
@@ -77,7 +88,7 @@ JSONNode StreamingDevice::stateToJSON(bool configOnly){
 	JSONNode channels(JSON_NODE);
 	channels.set_name("channels");
 	BOOST_FOREACH (Channel* c, this->channels){
-		channels.push_back(c->toJSON());
+		channels.push_back(c->toJSON(live));
 	}
 	n.push_back(channels);
 
@@ -85,19 +96,30 @@ JSONNode StreamingDevice::stateToJSON(bool configOnly){
 }
 
 void StreamingDevice::addListener(listener_ptr l){
+	state_lock lock(stateMutex);
 	if (l->handleNewData()){
 		listeners.insert(l);
+		if (ClientConn* c = l->getClient()){
+			listenerIndex[listener_key_t(c, l->id)] = l;
+		}
 	}
 }
 
 listener_ptr StreamingDevice::findListener(ClientConn* c, unsigned id){
-	BOOST_FOREACH(listener_ptr w, listeners){
-		if (w->isFromClient(c) && w->id == id) return w;
+	boost::unordered_map<listener_key_t, boost::weak_ptr<StreamListener> >::iterator it =
+		listenerIndex.find(listener_key_t(c, id));
+	if (it == listenerIndex.end()) return listener_ptr();
+	
+	listener_ptr w = it->second.lock();
+	if (!w || !listeners.count(w)){
+		listenerIndex.erase(it);
+		return listener_ptr();
 	}
-	return listener_ptr();
+	return w;
 }
 
 void StreamingDevice::cancelListen(listener_ptr c){
+	state_lock lock(stateMutex);
 	listener_set_t::iterator it = listeners.find(c);
 	if (it != listeners.end()){
 		listeners.erase(it);
@@ -105,7 +127,9 @@ void StreamingDevice::cancelListen(listener_ptr c){
 }
 
 void StreamingDevice::clearAllListeners(){
+	state_lock lock(stateMutex);
 	listeners.clear();
+	listenerIndex.clear();
 }
 
 void StreamingDevice::resetAllListeners(){
@@ -114,7 +138,14 @@ void StreamingDevice::resetAllListeners(){
 	}
 }
 
+void StreamingDevice::notifyStreamsChanging(){
+	BOOST_FOREACH(listener_ptr w, listeners){
+		w->streamsChanging();
+	}
+}
+
 void StreamingDevice::handleNewData(){
+	uint64_t start = monotonicMicros();
 	listener_set_t::iterator it;
 	for (it=listeners.begin(); it!=listeners.end();){
 		// Increment before (potentially) deleting the watch, as that invalidates the iterator
@@ -125,21 +156,62 @@ void StreamingDevice::handleNewData(){
 			listeners.erase(currentIt);
 		}
 	}
+	metrics.listenerTime.observeSince(start);
+}
+
+void StreamingDevice::writeMetrics(MetricsWriter& m){
+	string labels = metricLabel("device", getId());
+	
+	m.counter("connect_usb_in_transfers_total", "Completed USB IN transfers", labels, metrics.inTransfers.value);
+	m.counter("connect_usb_out_transfers_total", "Completed USB OUT transfers", labels, metrics.outTransfers.value);
+	m.counter("connect_usb_transfer_errors_total", "USB transfers that failed", labels, metrics.transferErrors.value);
+	m.counter("connect_packets_dropped_total", "Packets the device reported dropping", labels, metrics.packetsDropped.value);
+	m.histogram("connect_ingest_latency_seconds", "Time from the USB callback to ingest",
+		labels, metrics.ingestLatency);
+	m.histogram("connect_listener_fanout_seconds", "Time passing new samples to all listeners",
+		labels, metrics.listenerTime);
+	
+	state_lock lock(stateMutex);
+	double fill = captureSamples ? std::min(capture_i, captureSamples) / (double) captureSamples : 0;
+	m.gauge("connect_capture_buffer_fill_ratio", "Fraction of the capture ring holding samples", labels, fill);
+	m.gauge("connect_listeners", "Active stream listeners", labels, listeners.size());
+	
+	BOOST_FOREACH(listener_ptr l, listeners){
+		ClientConn* c = l->getClient();
+		if (!c) continue;
+		
+		std::ostringstream client, id;
+		client << c->id;
+		id << l->id;
+		m.histogram("connect_sample_age_seconds", "Age of the newest sample of each update when sent",
+			metricLabel("listener", id.str(), metricLabel("client", client.str(), labels)), *l->age);
+	}
 }
 	
 	
 void StreamingDevice::reset_capture(){
+	state_lock lock(stateMutex);
+	notifyStreamsChanging();
 	captureDone = false;
 	capture_i = 0;
 	capture_o = 0;
+	transferStampNext = 0;
+	historyNext = 0;
+	BOOST_FOREACH(Channel* c, channels){
+		BOOST_FOREACH(Stream* s, c->streams){
+			s->resetSegments();
+			if (s->history) s->history->clear();
+		}
+	}
 	on_reset_capture();
 	notifyCaptureReset();
 }
 
 void StreamingDevice::start_capture(){
+	state_lock lock(stateMutex);
 	if (!captureState){
 		if (captureDone) reset_capture();
-		std::cerr << "Start capture" <<std::endl;
+		logEvent(LOGLEVEL_INFO, LOGCAT_DEVICE, "Start capture");
 		on_start_capture();
 		captureState = true;
 		notifyCaptureState();
@@ -147,9 +219,10 @@ void StreamingDevice::start_capture(){
 }
 
 void StreamingDevice::pause_capture(){
+	state_lock lock(stateMutex);
 	if (captureState){
 		captureState = false;
-		std::cerr << "Pause capture" <<std::endl;
+		logEvent(LOGLEVEL_INFO, LOGCAT_DEVICE, "Pause capture");
 		on_pause_capture();
 		notifyCaptureState();
 	}
@@ -157,7 +230,7 @@ void StreamingDevice::pause_capture(){
 
 void StreamingDevice::done_capture(){
 	captureDone = true;
-	std::cerr << "Done capture" <<std::endl;
+	logEvent(LOGLEVEL_INFO, LOGCAT_DEVICE, "Done capture");
 	if (captureState){
 		captureState = false;
 		on_pause_capture();
@@ -166,11 +239,124 @@ void StreamingDevice::done_capture(){
 }
 
 void StreamingDevice::notifyCaptureState(){
+	stateChanged();
 	JSONNode n(JSON_NODE);
 	n.push_back(JSONNode("_action", "captureState"));
 	n.push_back(JSONNode("state", captureState));
 	n.push_back(JSONNode("done", captureDone));
 	broadcastJSON(n);
+	notifyStateDelta();
+}
+
+//// State deltas
+
+static bool jsonEqual(const JSONNode& a, const JSONNode& b){
+	if (a.type() != b.type() || a.size() != b.size()) return false;
+	if (a.type() == JSON_NODE || a.type() == JSON_ARRAY){
+		for (unsigned i=0; i<a.size(); i++){
+			if (a[i].name() != b[i].name() || !jsonEqual(a[i], b[i])) return false;
+		}
+		return true;
+	}
+	return a.as_string() == b.as_string();
+}
+
+static string jsonPointerEscape(const string& s){
+	string r;
+	BOOST_FOREACH(char c, s){
+		if (c == '~') r += "~0";
+		else if (c == '/') r += "~1";
+		else r += c;
+	}
+	return r;
+}
+
+static void jsonPatchOp(JSONNode& ops, const char* op, const string& path, const JSONNode* value){
+	JSONNode o(JSON_NODE);
+	o.push_back(JSONNode("op", op));
+	o.push_back(JSONNode("path", path));
+	if (value){
+		JSONNode v = value->duplicate();
+		v.set_name("value");
+		o.push_back(v);
+	}
+	ops.push_back(o);
+}
+
+/// Append JSON Patch (RFC 6902) operations turning object a into object b.
+/// Objects are compared member by member; arrays are replaced whole.
+static void jsonDiff(const JSONNode& a, const JSONNode& b, const string& path, JSONNode& ops){
+	for (JSONNode::const_iterator i=b.begin(); i!=b.end(); i++){
+		string p = path + "/" + jsonPointerEscape(i->name());
+		JSONNode::const_iterator j = a.find(i->name());
+		if (j == a.end()){
+			jsonPatchOp(ops, "add", p, &*i);
+		}else if (i->type() == JSON_NODE && j->type() == JSON_NODE){
+			jsonDiff(*j, *i, p, ops);
+		}else if (!jsonEqual(*i, *j)){
+			jsonPatchOp(ops, "replace", p, &*i);
+		}
+	}
+	for (JSONNode::const_iterator j=a.begin(); j!=a.end(); j++){
+		if (b.find(j->name()) == b.end()){
+			jsonPatchOp(ops, "remove", path + "/" + jsonPointerEscape(j->name()), 0);
+		}
+	}
+}
+
+/// Send each stateDeltas client the changes since the state it last saw.
+/// Called after each change that bumps stateVersion.
+void StreamingDevice::notifyStateDelta(bool listenersCleared){
+	if (deltaBases.empty()) return;
+	
+	JSONArenaPause pause; // the bases outlive any enclosing arena scope
+	JSONNode state = stateToJSON(false, false);
+	
+	std::map<ClientConn*, DeltaBase>::iterator it;
+	for (it=deltaBases.begin(); it!=deltaBases.end(); it++){
+		DeltaBase& base = it->second;
+		
+		JSONNode ops(JSON_ARRAY);
+		ops.set_name("ops");
+		jsonDiff(base.state, state, "", ops);
+		
+		if (ops.size() || listenersCleared){
+			JSONNode n(JSON_NODE);
+			n.push_back(JSONNode("_action", "deviceDelta"));
+			n.push_back(JSONNode("version", stateVersion));
+			n.push_back(JSONNode("base", base.version));
+			n.push_back(JSONNode("listenersCleared", listenersCleared));
+			n.push_back(ops);
+			it->first->sendJSON(n);
+		}
+		
+		base.state = state;
+		base.version = stateVersion;
+	}
+}
+
+/// Send the full state, which also becomes the base for a stateDeltas
+/// client's following deltas.
+void StreamingDevice::sendConfig(ClientConn* client){
+	JSONArenaScope arena;
+	JSONNode n(JSON_NODE);
+	n.push_back(JSONNode("_action", "deviceConfig"));
+	n.push_back(JSONNode("version", stateVersion));
+
+	JSONNode jstate = stateToJSON();
+	jstate.set_name("device");
+	n.push_back(jstate);
+	
+	client->sendJSON(n);
+	
+	if (client->stateDeltas){
+		JSONArenaPause pause;
+		DeltaBase& base = deltaBases[client];
+		base.state = stateToJSON(false, false);
+		base.version = stateVersion;
+	}else{
+		deltaBases.erase(client);
+	}
 }
 
 void StreamingDevice::notifyCaptureReset(){
@@ -181,19 +367,117 @@ void StreamingDevice::notifyCaptureReset(){
 }
 
 void StreamingDevice::notifyConfig(){
-	clearAllListeners();
+	stateChanged();
+	indexChannels();
+	
+	// A reconfiguration that keeps the same channels, streams and sample rate
+	// only restarts the capture, so stateDeltas clients keep their listeners.
+	bool compatible = ((int) devMode == configuredMode
+		&& rawMode == configuredRaw
+		&& sampleTime == configuredSampleTime);
+	configuredMode = devMode;
+	configuredRaw = rawMode;
+	configuredSampleTime = sampleTime;
 	
+	if (compatible){
+		// Everything else, including REST and group listeners, is cleared
+		for (listener_set_t::iterator it=listeners.begin(); it!=listeners.end();){
+			listener_set_t::iterator currentIt = it++;
+			ClientConn* c = (*currentIt)->getClient();
+			if (!c || !c->stateDeltas) listeners.erase(currentIt);
+		}
+		resetAllListeners();
+	}else{
+		clearAllListeners();
+	}
+	
+	JSONArenaScope arena;
 	JSONNode n(JSON_NODE);
 	n.push_back(JSONNode("_action", "deviceConfig"));
+	n.push_back(JSONNode("version", stateVersion));
 
 	JSONNode d = stateToJSON();
 	d.set_name("device");
 	n.push_back(d);
 
-	broadcastJSON(n);
+	BOOST_FOREACH(ClientConn* c, connections){
+		if (!c->stateDeltas) c->sendJSON(n);
+	}
+	notifyStateDelta(!compatible);
 }
 
-void StreamingDevice::packetDone(){
+void StreamingDevice::compressHistory(){
+	if (!captureContinuous || !captureSamples) return;
+	
+	// Blocks already overwritten in the ring can't be compressed
+	if (capture_i > captureSamples && historyNext < capture_i - captureSamples){
+		unsigned skip = capture_i - captureSamples - historyNext;
+		historyNext += (skip + HISTORY_BLOCK_SAMPLES - 1) / HISTORY_BLOCK_SAMPLES * HISTORY_BLOCK_SAMPLES;
+		BOOST_FOREACH(Channel* c, channels){
+			BOOST_FOREACH(Stream* s, c->streams){
+				if (s->history) s->history->clear();
+			}
+		}
+	}
+	
+	int16_t block[HISTORY_BLOCK_SAMPLES];
+	for (; historyNext + HISTORY_BLOCK_SAMPLES <= capture_i; historyNext += HISTORY_BLOCK_SAMPLES){
+		BOOST_FOREACH(Channel* c, channels){
+			BOOST_FOREACH(Stream* s, c->streams){
+				if (!s->history || !s->codes) continue;
+				for (unsigned i=0; i<HISTORY_BLOCK_SAMPLES; i++){
+					block[i] = s->codes[s->offset((historyNext + i) % captureSamples)];
+				}
+				s->history->append(historyNext, block);
+			}
+		}
+	}
+}
+
+float StreamingDevice::resampleHistory(Stream& s, unsigned start, unsigned count){
+	float total = 0;
+	unsigned i = start, end = start + count;
+	
+	while (i < end){
+		if (!s.history->contains(i)){
+			// The rest of the range is in the ring
+			total += get(s, i);
+			i++;
+			continue;
+		}
+		
+		const HistoryBlock& b = s.history->blockAt(i);
+		unsigned blockEnd = b.start + HISTORY_BLOCK_SAMPLES;
+		unsigned n = s.segmentAt(i);
+		const StreamSegment& seg = s.segments[n];
+		bool oneSegment = (n+1 >= s.segments.size() || s.segments[n+1].start >= blockEnd);
+		
+		if (i == b.start && blockEnd <= end && oneSegment){
+			// Whole block under one conversion: use its summary
+			total += (b.sum + b.nonzero*seg.offset) * seg.scale;
+			i = blockEnd;
+		}else{
+			total += s.decode(seg, s.history->get(i));
+			i++;
+		}
+	}
+	return total/count;
+}
+
+void StreamingDevice::packetDone(uint64_t stamp){
+	if (stamp){
+		TransferStamp& t = transferStamps[transferStampNext++ % TRANSFER_STAMPS];
+		t.end = capture_i;
+		t.at = stamp;
+	}
+	
+	compressHistory();
+	
+	// Let closed-loop sources see the new data before the listeners run
+	BOOST_FOREACH(Channel* c, channels){
+		if (c->source) c->source->handleNewData(this);
+	}
+	
 	handleNewData();
 	
 	if (!captureContinuous && capture_i >= captureSamples){
@@ -201,7 +485,24 @@ void StreamingDevice::packetDone(){
 	}
 }
 
+uint64_t StreamingDevice::sampleStamp(unsigned i){
+	uint64_t at = 0;
+	
+	// Walk back from the newest transfer to the first one holding i
+	unsigned n = std::min(transferStampNext, TRANSFER_STAMPS);
+	for (unsigned k=1; k<=n; k++){
+		TransferStamp& t = transferStamps[(transferStampNext - k) % TRANSFER_STAMPS];
+		if (t.end <= i) break;
+		at = t.at;
+	}
+	
+	// Samples before the oldest remembered transfer may be from any earlier one
+	if (n == TRANSFER_STAMPS && transferStamps[transferStampNext % TRANSFER_STAMPS].end > i) return 0;
+	return at;
+}
+
 void StreamingDevice::setOutput(Channel* channel, OutputSource* source){
+	state_lock lock(stateMutex);
 	source->initialize(capture_o, channel->source);
 	
 	if (channel->source){
@@ -214,34 +515,46 @@ void StreamingDevice::setOutput(Channel* channel, OutputSource* source){
 }
 
 void StreamingDevice::notifyOutputChanged(Channel *channel, OutputSource *source){
+	stateChanged();
 	JSONNode n(JSON_NODE);
 	n.push_back(JSONNode("_action", "outputChanged"));
 	n.push_back(JSONNode("channel", channel->id));
 	source->describeJSON(n);
+	source->statusJSON(n);
 	broadcastJSON(n);
+	notifyStateDelta();
 }
 
 void StreamingDevice::notifyGainChanged(Channel* channel, Stream* stream, int gain){
+	stateChanged();
 	JSONNode n(JSON_NODE);
 	n.push_back(JSONNode("_action", "gainChanged"));
 	n.push_back(JSONNode("channel", channel->id));
 	n.push_back(JSONNode("stream", stream->id));
 	n.push_back(JSONNode("gain", stream->getGain()));
 	broadcastJSON(n);
+	notifyStateDelta();
 }
 
-Channel* StreamingDevice::channelById(const string& id){
+void StreamingDevice::indexChannels(){
+	channelIndex.clear();
 	BOOST_FOREACH(Channel* c, channels){
-		if (c->id == id) return c;
+		channelIndex[c->id] = c;
+		c->streamIndex.clear();
+		BOOST_FOREACH(Stream* s, c->streams){
+			c->streamIndex[s->id] = s;
+		}
 	}
-	return 0;
+}
+
+Channel* StreamingDevice::channelById(const string& id){
+	boost::unordered_map<string, Channel*>::iterator it = channelIndex.find(id);
+	return (it != channelIndex.end()) ? it->second : 0;
 }
 
 Stream* Channel::streamById(const string& id){
-	BOOST_FOREACH(Stream *i, streams){
-		if (i->id == id) return i;
-	}
-	return 0;
+	boost::unordered_map<string, Stream*>::iterator it = streamIndex.find(id);
+	return (it != streamIndex.end()) ? it->second : 0;
 }
 
 Stream* StreamingDevice::findStream(const string& channelId, const string& streamId){
@@ -257,14 +570,183 @@ Stream* StreamingDevice::findStream(const string& channelId, const string& strea
 }
 
 void StreamingDevice::onDisconnect(){
+	state_lock lock(stateMutex);
 	Device::onDisconnect();
 	clearAllListeners();
 }
 
-bool Stream::allocate(unsigned size){
-	if (data){
-		free(data);
+void StreamingDevice::stopIngest(){
+	if (!ingestWork) return;
+	
+	ingestStopping = true;
+	delete ingestWork;
+	ingestWork = 0;
+	
+	if (ingestThread.get_id() == boost::this_thread::get_id()){
+		// Called from a handler: run the rest of the queue here, as the thread
+		// must not touch this object once it is destroyed.
+		ingest.poll();
+		ingest.stop();
+		ingestThread.detach();
+	}else{
+		// run() returns once the queue is empty
+		ingestThread.join();
+	}
+}
+
+/// Allocate a capture buffer according to the buffer policy flags. Large
+/// buffers are aligned to huge pages so the kernel can back them with huge
+/// pages, others to a cache line. Sets /mapped/ if the buffer must be freed
+/// with munmap.
+static void* allocBuffer(size_t bytes, bool& mapped){
+	void* p = 0;
+	mapped = false;
+	bool huge = (bytes >= HUGE_PAGE_SIZE && hugePagesFlag != HUGEPAGES_OFF);
+	
+#ifdef _WIN32
+	p = _aligned_malloc(bytes, CACHE_LINE_SIZE);
+	if (!p) return 0;
+#else
+#ifdef MAP_HUGETLB
+	if (huge && hugePagesFlag == HUGEPAGES_EXPLICIT){
+		size_t mapBytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		p = mmap(0, mapBytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED){
+			std::cerr << "Could not map huge pages; is vm.nr_hugepages set? Using normal pages" << std::endl;
+			p = 0;
+		}else{
+			mapped = true;
+		}
+	}
+#endif
+	if (!p){
+		if (posix_memalign(&p, huge ? HUGE_PAGE_SIZE : CACHE_LINE_SIZE, bytes) != 0) return 0;
+#ifdef MADV_HUGEPAGE
+		if (huge) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+	}
+	
+	if (lockBuffersFlag && mlock(p, bytes) != 0){
+		std::cerr << "Could not lock capture buffer; check RLIMIT_MEMLOCK" << std::endl;
+	}
+#endif
+	
+	if (prefaultBuffersFlag) memset(p, 0, bytes);
+	return p;
+}
+
+static void freeBuffer(void* p, size_t bytes, bool mapped){
+	if (!p) return;
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	if (lockBuffersFlag) munlock(p, bytes);
+	if (mapped){
+		munmap(p, (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	}else{
+		free(p);
+	}
+#endif
+}
+
+void Stream::release(){
+	if (ownsBuffer){
+		freeBuffer(data ? (void*) data : (void*) codes, bufferBytes, bufferMapped);
+	}
+	data = 0;
+	codes = 0;
+	ownsBuffer = false;
+	bufferBytes = 0;
+	bufferMapped = false;
+	
+	delete history;
+	history = 0;
+}
+
+bool Stream::allocate(unsigned size, bool compact, size_t historyBytes){
+	release();
+	size_t bytes = size * (compact ? sizeof(int16_t) : sizeof(float));
+	bool mapped;
+	void* buffer = allocBuffer(bytes, mapped);
+	if (!buffer) return false;
+	useSharedBuffer((char*) buffer, true, compact, 0, 1, historyBytes);
+	bufferBytes = bytes;
+	bufferMapped = mapped;
+	return true;
+}
+
+void Stream::useSharedBuffer(char* buffer, bool owner, bool compact, unsigned shift, unsigned stride, size_t historyBytes){
+	release();
+	clearSegments();
+	
+	if (compact){
+		codes = (int16_t*) buffer;
+		if (historyBytes) history = new SampleHistory(historyBytes);
+	}else{
+		data = (float*) buffer;
+	}
+	ownsBuffer = owner;
+	blockShift = shift;
+	blockMask = shift ? (1 << shift) - 1 : 0;
+	blockStride = stride;
+}
+
+void StreamingDevice::allocateStreams(unsigned samples){
+	using namespace boost::posix_time;
+	ptime before = microsec_clock::universal_time();
+	
+	BOOST_FOREACH(Channel* c, channels){
+		unsigned nstreams = c->streams.size();
+		if (interleavedLayoutFlag && nstreams > 1){
+			// Each block holds LAYOUT_BLOCK_SAMPLES of one stream, and the
+			// channel's streams take turns, so a channel's streams at the same
+			// index are on nearby cache lines.
+			size_t elem = compactStorageFlag ? sizeof(int16_t) : sizeof(float);
+			unsigned blocks = (samples + LAYOUT_BLOCK_SAMPLES - 1) / LAYOUT_BLOCK_SAMPLES;
+			size_t blockBytes = LAYOUT_BLOCK_SAMPLES * elem;
+			size_t bytes = blocks * nstreams * blockBytes;
+			bool mapped;
+			char* buffer = (char*) allocBuffer(bytes, mapped);
+			if (!buffer) throw ErrorStringException("Could not allocate sample buffer");
+			
+			for (unsigned j=0; j<nstreams; j++){
+				c->streams[j]->useSharedBuffer(buffer + j*blockBytes, j==0, compactStorageFlag,
+					LAYOUT_BLOCK_SHIFT, nstreams*LAYOUT_BLOCK_SAMPLES, historyBytesFlag);
+			}
+			c->streams[0]->bufferBytes = bytes;
+			c->streams[0]->bufferMapped = mapped;
+		}else{
+			BOOST_FOREACH(Stream* s, c->streams){
+				if (!s->allocate(samples, compactStorageFlag, historyBytesFlag)){
+					throw ErrorStringException("Could not allocate sample buffer");
+				}
+			}
+		}
+	}
+	
+	allocTime = (microsec_clock::universal_time() - before).total_microseconds() / 1000.0;
+	std::cerr << "    Allocated capture buffers in " << allocTime << " ms" << std::endl;
+}
+
+void Stream::setCodeScale(unsigned i, float scale, float offset, unsigned oldest){
+	if (segments.empty()) clearSegments();
+	StreamSegment& last = segments.back();
+	if (last.scale == scale && last.offset == offset) return;
+	
+	if (last.start >= i){
+		// No samples stored under the last segment yet
+		last.scale = scale;
+		last.offset = offset;
+	}else{
+		StreamSegment seg = {i, scale, offset};
+		segments.push_back(seg);
+	}
+	
+	if (history && !history->empty() && history->start() < oldest){
+		oldest = history->start();
 	}
-	data = (float *) malloc(size*sizeof(float));
-	return !!data;
+	
+	unsigned drop = 0;
+	while (drop+1 < segments.size() && segments[drop+1].start <= oldest) drop++;
+	if (drop) segments.erase(segments.begin(), segments.begin()+drop);
 }
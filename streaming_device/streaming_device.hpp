@@ -10,11 +10,17 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/weak_ptr.hpp>
 #include <set>
 #include <map>
 #include <vector>
+#include <stdint.h>
 
 #include "../dataserver.hpp"
+#include "../metrics.hpp"
 
 struct StreamListener;
 typedef boost::shared_ptr<StreamListener> listener_ptr;
@@ -24,6 +30,29 @@ struct Channel;
 struct Stream;
 struct OutputSource;
 
+/// Conversion of a compact stream's codes to values, for samples from capture
+/// index `start` until the next segment: value = (code + offset) * scale
+struct StreamSegment{
+	unsigned start;
+	float scale;
+	float offset;
+};
+
+const size_t CACHE_LINE_SIZE = 64;
+const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+/// Block size of the interleaved stream layout: 16 floats is one cache line
+const unsigned LAYOUT_BLOCK_SHIFT = 4;
+const unsigned LAYOUT_BLOCK_SAMPLES = 1 << LAYOUT_BLOCK_SHIFT;
+
+/// Transfers whose arrival times are kept for sample age tracing
+const unsigned TRANSFER_STAMPS = 64;
+
+/// Compact-storage code for a sample whose value is exactly 0
+const int16_t STREAM_CODE_ZERO = INT16_MIN;
+
+#include "sample_history.hpp"
+
 struct Stream{
 	Stream(const string _id, const string _dn, const string _units, float _min, float _max, unsigned _outputMode=0, float _uncertainty=0, unsigned _gain=1):
 		id(_id),
@@ -36,12 +65,20 @@ struct Stream{
 		gain(_gain),
 		normalGain(_gain),
 		uncertainty(_uncertainty),
-		data(0){};
+		data(0),
+		codes(0),
+		history(0),
+		ownsBuffer(false),
+		bufferBytes(0),
+		bufferMapped(false),
+		blockShift(0),
+		blockMask(0),
+		blockStride(1){
+		clearSegments();
+	}
 
 	~Stream(){
-		if (data){
-			free(data);
-		}
+		release();
 	}
 	
 	JSONNode toJSON();
@@ -54,8 +91,22 @@ struct Stream{
 
 	string state;
 
-	/// Allocate space for /size/ samples
-	bool allocate(unsigned size);
+	/// Allocate space for /size/ samples, as raw codes if /compact/. Compact
+	/// streams also keep up to /historyBytes/ of older samples compressed.
+	bool allocate(unsigned size, bool compact=false, size_t historyBytes=0);
+	
+	/// Use part of a buffer shared with the other streams of a channel, in
+	/// blocks of 2^shift samples, each stream's blocks /stride/ elements apart.
+	/// The owner frees the buffer.
+	void useSharedBuffer(char* buffer, bool owner, bool compact, unsigned shift, unsigned stride, size_t historyBytes);
+	
+	/// Free the buffers
+	void release();
+	
+	/// Element of data or codes holding ring position i
+	inline unsigned offset(unsigned i){
+		return (i >> blockShift) * blockStride + (i & blockMask);
+	}
 
 	/// mode for output that "sources" this stream's variable
 	/// 0 if outputting this variable is not supported.
@@ -73,12 +124,70 @@ struct Stream{
 
 	/// Raw data buffer
 	float* data;
+	
+	/// Raw codes, used instead of data in compact storage mode
+	int16_t* codes;
+	
+	/// Compressed samples from before the start of the codes buffer, or 0
+	SampleHistory* history;
+	
+	/// Layout of data or codes, see offset()
+	bool ownsBuffer;
+	size_t bufferBytes;
+	bool bufferMapped;
+	unsigned blockShift, blockMask, blockStride;
+	
+	/// Conversions in effect for the codes in the buffer and history, oldest first
+	std::vector<StreamSegment> segments;
+	
+	/// Set the conversion for codes stored from capture index i on. Segments
+	/// ending before index `oldest` are dropped.
+	void setCodeScale(unsigned i, float scale, float offset, unsigned oldest);
+	
+	/// Replace the segments with the identity conversion
+	void clearSegments(){
+		StreamSegment identity = {0, 1, 0};
+		segments.assign(1, identity);
+	}
+	
+	/// Keep only the current conversion, starting at index 0, when the capture
+	/// restarts.
+	void resetSegments(){
+		if (segments.empty()) return clearSegments();
+		StreamSegment last = segments.back();
+		last.start = 0;
+		segments.assign(1, last);
+	}
+	
+	/// Index of the segment that applies to capture index i. Usually the last.
+	inline unsigned segmentAt(unsigned i){
+		unsigned n = segments.size() - 1;
+		while (n > 0 && segments[n].start > i) n--;
+		return n;
+	}
+	
+	inline float decode(const StreamSegment& seg, int16_t code){
+		if (code == STREAM_CODE_ZERO) return 0;
+		return (code + seg.offset) * seg.scale;
+	}
 };
 
 
+/// Threading model:
+///   USB thread:    transfer callbacks and OutputSource::getValue, the latter
+///                  under the device's output lock.
+///   Ingest thread: one per device. Stores incoming transfers and runs the
+///                  listeners and output sources' handleNewData.
+///   Main thread:   client messages, REST requests and configuration.
+/// The listeners, channels, stream data and capture counters are guarded by
+/// stateMutex, which the ingest thread holds for each transfer and every
+/// main-thread entry point takes. ClientConn::sendJSON may be called from
+/// either thread; the message is sent from the main thread.
 class StreamingDevice: public Device{
 	public: 
 		StreamingDevice(double _sampleTime):
+			ingestStopping(false),
+			rawMode(false),
 			captureState(false),
 			captureDone(false),
 			captureLength(0),
@@ -86,13 +195,61 @@ class StreamingDevice: public Device{
 			captureContinuous(false),
 			sampleTime(_sampleTime),
 			capture_i(0),
-			capture_o(0) {}
+			capture_o(0),
+			allocTime(0),
+			transferStampNext(0),
+			historyNext(0),
+			stateVersion(0),
+			configuredMode(-1),
+			configuredRaw(false),
+			configuredSampleTime(0),
+			ingestWork(new boost::asio::io_service::work(ingest)),
+			ingestThread(boost::bind(&boost::asio::io_service::run, &ingest)) {}
+		
+		virtual ~StreamingDevice(){
+			stopIngest();
+		}
 		
-		virtual JSONNode stateToJSON(bool configOnly=false);
+		typedef boost::recursive_mutex::scoped_lock state_lock;
+		boost::recursive_mutex stateMutex;
+		
+		/// Queue for work done on this device's ingest thread
+		boost::asio::io_service ingest;
+		
+		/// Set by stopIngest. Handlers still queued on the ingest thread must
+		/// only release what they own, such as transfer buffers.
+		volatile bool ingestStopping;
+		
+		/// Finish the ingest thread, letting it drain its queue. Must be called
+		/// by subclass destructors before their members are destroyed.
+		void stopIngest();
+		
+		/// The device's state. Without /live/, output sources' running status,
+		/// which changes without a stateChanged(), is left out.
+		virtual JSONNode stateToJSON(bool configOnly=false, bool live=true);
+		virtual void writeMetrics(MetricsWriter& m);
+		
+		/// Data path counters, updated without locks from the USB and ingest
+		/// threads
+		struct DataPathMetrics{
+			MetricCounter inTransfers;
+			MetricCounter outTransfers;
+			MetricCounter transferErrors;
+			MetricCounter packetsDropped;
+			
+			/// From the USB callback to the start of its handling on the ingest thread
+			MetricHistogram ingestLatency;
+			
+			/// Passing a transfer's new samples to all the listeners
+			MetricHistogram listenerTime;
+		} metrics;
 		
 		virtual void onClientAttach(ClientConn *c);
 		virtual void onClientDetach(ClientConn *c);
 		virtual bool processMessage(ClientConn& session, string& cmd, JSONNode& n);
+		virtual bool processMessageView(ClientConn& session, string& cmd, JSONViewNode& n);
+		virtual bool handlesMessageView(const string& cmd);
+		virtual bool processBinaryMessage(ClientConn& session, const std::vector<unsigned char>& data);
 		virtual bool handleREST(UrlPath path, websocketpp::session_ptr client);
 		
 		listener_set_t listeners;
@@ -164,37 +321,111 @@ class StreamingDevice: public Device{
 
 		std::vector<Channel*> channels;
 		
-		/// Store a sample to a stream
+		/// Allocate the channels' stream buffers for /samples/ samples, in the
+		/// layout, storage format and page policy selected by the server flags.
+		void allocateStreams(unsigned samples);
+		
+		/// Milliseconds the last allocateStreams took, including prefaulting
+		double allocTime;
+		
+		/// Ring of recent transfers: the capture index just past each one's
+		/// samples, and when it completed
+		struct TransferStamp{
+			unsigned end;
+			uint64_t at;
+		};
+		TransferStamp transferStamps[TRANSFER_STAMPS];
+		unsigned transferStampNext;
+		
+		/// Rebuild the id indexes of channels and their streams. Called by
+		/// notifyConfig, after a subclass's configure has replaced them.
+		void indexChannels();
+		
+		/// Store a sample to a stream. Compact streams can only store 0 this way.
 		/// Note: when you are done putting samples, call sampleDone();
 		inline void put(Stream& s, float p){
-			if (!s.data || !captureSamples || (capture_i>=captureSamples && !captureContinuous)) return;
-			s.data[capture_i % captureSamples]=p;
+			if (!captureSamples || (capture_i>=captureSamples && !captureContinuous)) return;
+			if (s.data){
+				s.data[s.offset(capture_i % captureSamples)]=p;
+			}else if (s.codes && p == 0){
+				s.codes[s.offset(capture_i % captureSamples)] = STREAM_CODE_ZERO;
+			}
+		}
+		
+		/// Store a raw code to a stream, converted by the stream's current
+		/// segment. Streams not in compact mode store the value from /table/.
+		inline void putCode(Stream& s, int16_t code, const float* table, unsigned tableIndex){
+			if (!captureSamples || (capture_i>=captureSamples && !captureContinuous)) return;
+			if (s.codes){
+				s.codes[s.offset(capture_i % captureSamples)] = code;
+			}else if (s.data){
+				s.data[s.offset(capture_i % captureSamples)] = table[tableIndex];
+			}
 		}
 
 		/// Get the sample corresponding to buffer_i==i. If it is not in
 		/// memory (either overwritten or not yet collected), returns NaN. 
 		inline float get(Stream& s, unsigned i){
-			if (   !s.data || !captureSamples   // not prepared
-				|| i>=capture_i             // not yet collected
-				|| (capture_i>captureSamples && i<=capture_i-captureSamples)) // overwritten
+			if (   (!s.data && !s.codes) || !captureSamples   // not prepared
+				|| i>=capture_i)             // not yet collected
+				return NAN;
+			else if (capture_i>captureSamples && i<=capture_i-captureSamples){ // overwritten
+				if (s.history && s.history->contains(i))
+					return s.decode(s.segments[s.segmentAt(i)], s.history->get(i));
 				return NAN;
+			}
+			else if (s.data)
+				return s.data[s.offset(i%captureSamples)];
 			else
-				return s.data[i%captureSamples];
+				return s.decode(s.segments[s.segmentAt(i)], s.codes[s.offset(i%captureSamples)]);
 		}
 		
 		
 		inline float resample(Stream& s, unsigned start, unsigned count){
-			if (   !s.data || !captureSamples   // not prepared
-				|| start+count > capture_i             // not yet collected
-				|| (capture_i>captureSamples && start<=capture_i-captureSamples)) // overwritten
+			if (   (!s.data && !s.codes) || !captureSamples   // not prepared
+				|| start+count > capture_i)             // not yet collected
+				return NAN;
+			else if (capture_i>captureSamples && start<=capture_i-captureSamples){ // overwritten
+				if (s.history && s.history->contains(start)) return resampleHistory(s, start, count);
 				return NAN;
+			}
 			float total = 0;
-			for (unsigned i=0; i<count; i++){
-				total += s.data[(start+i)%captureSamples];
+			if (s.data){
+				for (unsigned i=0; i<count; i++){
+					total += s.data[s.offset((start+i)%captureSamples)];
+				}
+			}else{
+				// Sum the codes of each segment's part of the range, then convert once
+				unsigned i = 0;
+				while (i < count){
+					unsigned n = s.segmentAt(start+i);
+					const StreamSegment& seg = s.segments[n];
+					unsigned end = count;
+					if (n+1 < s.segments.size() && s.segments[n+1].start - start < end){
+						end = s.segments[n+1].start - start;
+					}
+					int64_t sum = 0;
+					unsigned nonzero = 0;
+					for (; i<end; i++){
+						int16_t code = s.codes[s.offset((start+i)%captureSamples)];
+						if (code != STREAM_CODE_ZERO){ sum += code; nonzero++; }
+					}
+					total += (sum + nonzero*seg.offset) * seg.scale;
+				}
 			}
 			return total/count;
 		}
 
+		/// resample for a range starting in a stream's compressed history
+		float resampleHistory(Stream& s, unsigned start, unsigned count);
+		
+		/// Compress the blocks of compact streams' samples completed since the
+		/// last call into their histories. Called by packetDone.
+		void compressHistory();
+		
+		/// Capture index of the next sample to compress
+		unsigned historyNext;
+		
 		/// Returns the lowest buffer index currently available
 		inline unsigned buffer_min(){
 			if (capture_i < captureSamples)
@@ -216,7 +447,17 @@ class StreamingDevice: public Device{
 		int currentLimit;
 		virtual void setCurrentLimit(unsigned limit){}
 		
-		void packetDone();
+		/// Incremented whenever anything in stateToJSON changes, except the live
+		/// output status
+		volatile unsigned stateVersion;
+		
+		/// Call after storing a transfer's samples. /stamp/ is the
+		/// monotonicMicros time its USB transfer completed, if known.
+		void packetDone(uint64_t stamp=0);
+		
+		/// The time the transfer holding sample /i/ completed, or 0 if it is
+		/// older than the ones remembered
+		uint64_t sampleStamp(unsigned i);
 		
 		/// Find a stream by its channel id and stream id
 		Stream* findStream(const string& channelId, const string& streamId);
@@ -224,11 +465,19 @@ class StreamingDevice: public Device{
 		virtual void onDisconnect();
 
 	protected:
+		void stateChanged(){ __sync_fetch_and_add(&stateVersion, 1); }
 		void notifyCaptureState();
 		void notifyConfig();
 		void notifyCaptureReset();
 		void notifyOutputChanged(Channel *channel, OutputSource *outputSource);
 		void notifyGainChanged(Channel* channel, Stream* stream, int gain);
+		void notifyStateDelta(bool listenersCleared=false);
+		
+		/// Tell the listeners that the streams are about to be reset or
+		/// reallocated. Call with stateMutex held.
+		void notifyStreamsChanging();
+		void sendConfig(ClientConn* client);
+		void appendSamples(ClientConn& client, Channel* channel, const float* values, unsigned count, unsigned id);
 		void done_capture();
 		void handleNewData();
 		
@@ -242,16 +491,54 @@ class StreamingDevice: public Device{
 		void handleRESTConfigurationCallback(websocketpp::session_ptr client, string postdata);
 		void RESTConfigurationRespond(websocketpp::session_ptr client);
 		
+		/// Serialized REST response bodies, valid while version == stateVersion
+		struct RESTCacheEntry{
+			RESTCacheEntry(): version(0){}
+			unsigned version;
+			string body;
+		};
+		std::map<string, RESTCacheEntry> restCache;
+		void respondRESTCached(websocketpp::session_ptr client, const string& key, boost::function<JSONNode()> build);
+		
 		virtual void on_reset_capture() = 0;
 		virtual void on_start_capture() = 0;
 		virtual void on_pause_capture() = 0;
+	
+	private:
+		/// State last sent to a stateDeltas client, which its deltas are
+		/// computed against. Live output status is left out.
+		struct DeltaBase{
+			JSONNode state;
+			unsigned version;
+		};
+		std::map<ClientConn*, DeltaBase> deltaBases;
+		
+		/// Configuration at the last notifyConfig, to tell whether listeners can
+		/// survive a reconfiguration
+		int configuredMode;
+		bool configuredRaw;
+		double configuredSampleTime;
+		
+		/// channels by id
+		boost::unordered_map<string, Channel*> channelIndex;
+		
+		/// Listeners by client and the client's id for them. Entries are
+		/// checked against `listeners` on lookup, so stale ones are harmless.
+		typedef std::pair<ClientConn*, unsigned> listener_key_t;
+		boost::unordered_map<listener_key_t, boost::weak_ptr<StreamListener> > listenerIndex;
+		
+		/// Commands shared by processMessage and processMessageView
+		template <class Node> bool processCommonMessage(ClientConn& client, string& cmd, Node& n);
+		
+		boost::asio::io_service::work* ingestWork;
+		boost::thread ingestThread;
 };
 
 struct Channel{
 	Channel(const string _id, const string _dn):
 		id(_id), displayName(_dn), source(0){}
 		
-	JSONNode toJSON();
+	JSONNode toJSON(bool live=true);
 	
 	const string id;
 	const string displayName;
@@ -259,6 +546,9 @@ struct Channel{
 	Stream* streamById(const std::string&);
 	
 	std::vector<Stream*> streams;
+	
+	/// streams by id, rebuilt by StreamingDevice::indexChannels
+	boost::unordered_map<string, Stream*> streamIndex;
 	OutputSource *source;
 };
 
@@ -269,6 +559,9 @@ struct OutputSource{
 	virtual float getValue(unsigned sample, double sampleTime) = 0;
 	
 	virtual void describeJSON(JSONNode &n);
+	
+	/// Values that change as the source runs, without a stateChanged()
+	virtual void statusJSON(JSONNode &n){}
 
 	const unsigned mode;
 	
@@ -284,6 +577,10 @@ struct OutputSource{
 	virtual void initialize(unsigned sample, OutputSource* prevSrc){};
 	
 	virtual double getPhaseZeroAfterSample(unsigned sample){return INFINITY;}
+	
+	/// Called after each IN transfer has been stored, before listeners run.
+	/// Sources that depend on input samples update their state here.
+	virtual void handleNewData(StreamingDevice* device){}
 
 	virtual ~OutputSource(){};
 
@@ -298,8 +595,44 @@ struct ArbWavePoint{
 };
 typedef std::vector<ArbWavePoint> ArbWavePoint_vec;
 
+/// Source fed incrementally with appendSamples, for waveforms too long to
+/// send in one message. The main thread appends and fillOutTransfer consumes
+/// without a lock; if the buffer runs dry the last value is held.
+struct BufferedSource: public OutputSource{
+	BufferedSource(unsigned m, unsigned size, float initial);
+	virtual string displayName(){return "buffered";}
+	virtual float getValue(unsigned sample, double sampleTime);
+	virtual void describeJSON(JSONNode &n);
+	
+	/// Queue samples for output. Returns the number accepted, which is less
+	/// than count if the buffer is full.
+	unsigned append(const float* values, unsigned count);
+	
+	unsigned fill(){return head - tail;}
+	unsigned size(){return buffer.size();}
+	
+	virtual void statusJSON(JSONNode &n);
+	
+	std::vector<float> buffer;
+	
+	/// buffer.size() - 1. The size is a power of two, so the free-running
+	/// counters stay consistent when they wrap.
+	unsigned mask;
+	
+	/// Total samples written and read; index is masked by buffer size
+	volatile unsigned head, tail;
+	
+	/// Number of output samples for which no data was available
+	volatile unsigned underruns;
+	
+	float lastValue;
+};
+
+/// Largest buffer a client can request for a BufferedSource, in samples
+const unsigned BUFFERED_SOURCE_MAX_SIZE = 1<<22;
+
 OutputSource *makeConstantSource(unsigned m, float value);
-OutputSource *makeSource(JSONNode& description);
+template <class Node> OutputSource *makeSource(Node& description, StreamingDevice* device);
 OutputSource* makeSource(unsigned mode, const string& source, float offset, float amplitude, double period, double phase, bool relPhase);
 OutputSource* makeAdvSquare(unsigned mode, float high, float low, unsigned highSamples, unsigned lowSamples, unsigned phase, bool relPhase);
 OutputSource* makeArbitraryWaveform(unsigned mode, int offset, ArbWavePoint_vec& values, int repeat_count);
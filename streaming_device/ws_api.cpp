@@ -8,8 +8,10 @@
 
 #include "streaming_device.hpp"
 #include "stream_listener.hpp"
+#include <algorithm>
 
-bool StreamingDevice::processMessage(ClientConn& client, string& cmd, JSONNode& n){
+template <class Node>
+bool StreamingDevice::processCommonMessage(ClientConn& client, string& cmd, Node& n){
 	if (cmd == "listen"){
 		cancelListen(findListener(&client, jsonIntProp(n, "id")));
 		addListener(makeStreamListener(this, &client, n));
@@ -34,7 +36,42 @@ bool StreamingDevice::processMessage(ClientConn& client, string& cmd, JSONNode&
 	}else if (cmd == "set"){
 		Channel *channel = channelById(jsonStringProp(n, "channel"));
 		if (!channel) throw ErrorStringException("Channel not found");
-		setOutput(channel, makeSource(n));
+		setOutput(channel, makeSource(n, this));
+		
+	}else if (cmd == "appendSamples"){
+		Channel *channel = channelById(jsonStringProp(n, "channel"));
+		if (!channel) throw ErrorStringException("Channel not found");
+		
+		std::vector<float> values;
+		Node j_values = n.at("values");
+		for(typename Node::iterator i=j_values.begin(); i!=j_values.end(); i++){
+			values.push_back(i->as_float());
+		}
+		
+		appendSamples(client, channel, values.size()?&values[0]:0, values.size(), jsonIntProp(n, "id", 0));
+		
+	}else{
+		return false;
+	}
+	return true;
+}
+
+bool StreamingDevice::processMessageView(ClientConn& client, string& cmd, JSONViewNode& n){
+	state_lock lock(stateMutex);
+	return processCommonMessage(client, cmd, n);
+}
+
+/// The commands of processCommonMessage
+bool StreamingDevice::handlesMessageView(const string& cmd){
+	return cmd == "listen" || cmd == "cancelListen" || cmd == "configure"
+		|| cmd == "startCapture" || cmd == "pauseCapture" || cmd == "set"
+		|| cmd == "appendSamples";
+}
+
+bool StreamingDevice::processMessage(ClientConn& client, string& cmd, JSONNode& n){
+	state_lock lock(stateMutex);
+	if (processCommonMessage(client, cmd, n)){
+		return true;
 		
 	}else if (cmd == "setGain"){
 		Channel *channel = channelById(jsonStringProp(n, "channel"));
@@ -49,30 +86,65 @@ bool StreamingDevice::processMessage(ClientConn& client, string& cmd, JSONNode&
 	}else if (cmd == "setCurrentLimit"){
 		unsigned limit = jsonFloatProp(n, "currentLimit");
 		setCurrentLimit(limit);
+		
+	}else if (cmd == "stateDeltas"){
+		client.stateDeltas = jsonBoolProp(n, "enable", true);
+		sendConfig(&client);
+		
 	}else{
 		return false;
 	}
 	return true;
 }
 
-
-void StreamingDevice::onClientAttach(ClientConn* client){
-	Device::onClientAttach(client);
+/// Binary messages append samples to a buffered source. The format is the
+/// channel id, a NUL byte, then little-endian float32 samples.
+bool StreamingDevice::processBinaryMessage(ClientConn& client, const std::vector<unsigned char>& data){
+	state_lock lock(stateMutex);
+	std::vector<unsigned char>::const_iterator sep = std::find(data.begin(), data.end(), 0);
+	if (sep == data.end()) throw ErrorStringException("Binary message has no channel id");
+	
+	Channel *channel = channelById(string(data.begin(), sep));
+	if (!channel) throw ErrorStringException("Channel not found");
+	
+	unsigned offset = sep - data.begin() + 1;
+	unsigned count = (data.size() - offset) / sizeof(float);
+	
+	std::vector<float> values(count);
+	if (count) memcpy(&values[0], &data[offset], count*sizeof(float));
 	
-	JSONNode n(JSON_NODE);
-	n.push_back(JSONNode("_action", "deviceConfig"));
+	appendSamples(client, channel, count?&values[0]:0, count, 0);
+	return true;
+}
 
-	JSONNode jstate = stateToJSON();
-	jstate.set_name("device");
-	n.push_back(jstate);
+void StreamingDevice::appendSamples(ClientConn& client, Channel* channel, const float* values, unsigned count, unsigned id){
+	BufferedSource* source = dynamic_cast<BufferedSource*>(channel->source);
+	if (!source) throw ErrorStringException("Channel output is not a buffered source");
+	
+	unsigned accepted = source->append(values, count);
 	
-	client->sendJSON(n);
+	JSONNode reply(JSON_NODE);
+	reply.push_back(JSONNode("_action", "appendStatus"));
+	reply.push_back(JSONNode("id", id));
+	reply.push_back(JSONNode("channel", channel->id));
+	reply.push_back(JSONNode("accepted", accepted));
+	reply.push_back(JSONNode("bufferSize", source->size()));
+	source->statusJSON(reply);
+	client.sendJSON(reply);
+}
+
+void StreamingDevice::onClientAttach(ClientConn* client){
+	state_lock lock(stateMutex);
+	Device::onClientAttach(client);
+	sendConfig(client);
 }
 
 void StreamingDevice::onClientDetach(ClientConn* client){
+	state_lock lock(stateMutex);
 	Device::onClientDetach(client);
+	deltaBases.erase(client);
 	
-	std::cout << "Client disconnected. " << listeners.size() << std::endl;
+	logEvent(LOGLEVEL_INFO, LOGCAT_CLIENT, "Client disconnected. %u", (unsigned) listeners.size());
 	
 	listener_set_t::iterator it;
 	for (it=listeners.begin(); it!=listeners.end();){
@@ -84,6 +156,12 @@ void StreamingDevice::onClientDetach(ClientConn* client){
 			listeners.erase(currentIt);
 		}
 	}
+	
+	boost::unordered_map<listener_key_t, boost::weak_ptr<StreamListener> >::iterator i;
+	for (i=listenerIndex.begin(); i!=listenerIndex.end();){
+		if (i->first.first == client) i = listenerIndex.erase(i);
+		else ++i;
+	}
 }
 
 
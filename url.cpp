@@ -8,12 +8,16 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <limits>
 #include "url.hpp"
 
-typedef std::string::const_iterator iterator_t;
 using std::string;
 
-string map_get(std::map<string, string>& map, const string key, const string def){
+string map_get(std::map<string, string>& map, const string& key, const string& def){
 	std::map<std::string, std::string>::iterator it = map.find(key);
 	if (it != map.end()){
 		return it->second;
@@ -39,15 +43,121 @@ void parse_query(const string& query, std::map<string, string>& map){
 		}
 }
 
+/// Copy s to a terminated buffer for strto*, checking it only has /chars/
+static void num_buffer(const char* s, size_t len, char* buf, size_t size, const char* chars){
+	bool valid = (len > 0 && len < size);
+	for (size_t i=0; valid && i<len; i++){
+		valid = s[i] && strchr(chars, s[i]);
+	}
+	if (!valid) throw std::invalid_argument("Invalid number: " + string(s, len));
+	memcpy(buf, s, len);
+	buf[len] = 0;
+}
+
+static std::invalid_argument num_error(const char* buf){
+	return std::invalid_argument("Invalid number: " + string(buf));
+}
+
+void parse_num(const char* s, size_t len, double& out){
+	char buf[64];
+	num_buffer(s, len, buf, sizeof(buf), "0123456789+-.eE");
+	
+	char* end;
+	errno = 0;
+	out = strtod(buf, &end);
+	if (end != buf + len || errno == ERANGE) throw num_error(buf);
+}
+
+void parse_num(const char* s, size_t len, float& out){
+	double v;
+	parse_num(s, len, v);
+	if (fabs(v) > std::numeric_limits<float>::max()) throw std::invalid_argument("Number out of range");
+	out = v;
+}
 
-Url::Url(const string url){
-	iterator_t queryStart = std::find(url.begin(), url.end(), '?');
-	string path(url.begin(), queryStart);
-	boost::split(pathparts, path, boost::is_any_of("/"));
+void parse_num(const char* s, size_t len, long& out){
+	char buf[32];
+	num_buffer(s, len, buf, sizeof(buf), "0123456789+-");
 	
-	if (pathparts.at(pathparts.size()-1) == "") pathparts.pop_back(); // Remove trailing /
+	char* end;
+	errno = 0;
+	out = strtol(buf, &end, 10);
+	if (end != buf + len || errno == ERANGE) throw num_error(buf);
+}
+
+void parse_num(const char* s, size_t len, int& out){
+	long v;
+	parse_num(s, len, v);
+	if (v < INT_MIN || v > INT_MAX) throw std::invalid_argument("Number out of range");
+	out = v;
+}
+
+void parse_num(const char* s, size_t len, unsigned long& out){
+	char buf[32];
+	// No sign: strtoul would wrap a negative number around
+	num_buffer(s, len, buf, sizeof(buf), "0123456789");
 	
-	if (queryStart != url.end()) queryStart++; // skip '?'
-	string query(queryStart, url.end());
-	parse_query(query, params);
+	char* end;
+	errno = 0;
+	out = strtoul(buf, &end, 10);
+	if (end != buf + len || errno == ERANGE) throw num_error(buf);
+}
+
+void parse_num(const char* s, size_t len, unsigned& out){
+	unsigned long v;
+	parse_num(s, len, v);
+	if (v > UINT_MAX) throw std::invalid_argument("Number out of range");
+	out = v;
+}
+
+Url::Url(const string& url): text(url), nparts(0){
+	size_t queryStart = text.find('?');
+	size_t pathEnd = (queryStart == string::npos) ? text.size() : queryStart;
+	
+	if (queryStart == string::npos){
+		query.start = text.size();
+		query.len = 0;
+	}else{
+		query.start = queryStart + 1;
+		query.len = text.size() - query.start;
+	}
+	
+	// Same parts as splitting on '/': the leading slash gives an empty first part
+	size_t start = 0;
+	for (;;){
+		size_t sep = text.find('/', start);
+		if (sep == string::npos || sep > pathEnd) sep = pathEnd;
+		
+		if (nparts >= URL_MAX_PARTS) throw std::out_of_range("URL path too long");
+		pathparts[nparts].start = start;
+		pathparts[nparts].len = sep - start;
+		nparts++;
+		
+		if (sep == pathEnd) break;
+		start = sep + 1;
+	}
+	
+	if (pathparts[nparts-1].len == 0) nparts--; // Remove trailing /
+}
+
+bool Url::findParam(const char* key, UrlSlice& value) const{
+	size_t keyLen = strlen(key);
+	const char* p = ptr(query);
+	const char* end = p + query.len;
+	bool found = false;
+	
+	// Keep scanning, so a repeated key gives its last value like parse_query
+	while (p < end){
+		const char* pairEnd = (const char*) memchr(p, '&', end - p);
+		if (!pairEnd) pairEnd = end;
+		
+		const char* eq = (const char*) memchr(p, '=', pairEnd - p);
+		if (eq && (size_t)(eq - p) == keyLen && memcmp(p, key, keyLen) == 0){
+			value.start = eq + 1 - text.data();
+			value.len = pairEnd - (eq + 1);
+			found = true;
+		}
+		p = pairEnd + 1;
+	}
+	return found;
 }
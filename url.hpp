@@ -10,26 +10,62 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <boost/lexical_cast.hpp>
+#include <cstring>
+#include <stdexcept>
 using std::string;
 
 void parse_query(const string& query, std::map<string, string>& map);
-string map_get(std::map<string, string>& map, const string key, const string def="");
+string map_get(std::map<string, string>& map, const string& key, const string& def="");
+
+/// Parse a decimal number without the stream machinery of lexical_cast.
+/// Throws std::invalid_argument unless the whole string is a number that fits
+/// in /out/; integers must not have a fraction or exponent.
+void parse_num(const char* s, size_t len, double& out);
+void parse_num(const char* s, size_t len, float& out);
+void parse_num(const char* s, size_t len, long& out);
+void parse_num(const char* s, size_t len, int& out);
+void parse_num(const char* s, size_t len, unsigned long& out);
+void parse_num(const char* s, size_t len, unsigned& out);
 
 template <class T>
-T map_get_num(std::map<string, string>& map, const string key, const T def){
+T map_get_num(std::map<string, string>& map, const string& key, const T def){
 	std::map<std::string, std::string>::iterator it = map.find(key);
 	if (it != map.end()){
-		return boost::lexical_cast<T>(it->second);
+		T v;
+		parse_num(it->second.data(), it->second.size(), v);
+		return v;
 	}else{
 		return def;
 	}
 }
 
+/// A piece of the request string, by offset so Url can be copied.
+struct UrlSlice{
+	unsigned start;
+	unsigned len;
+};
+
+const unsigned URL_MAX_PARTS = 16;
+
+/// Splits the path into slices of the resource string. The query string is
+/// left unparsed until a parameter is requested.
 struct Url{
-	Url(const string url);
-	std::vector<std::string> pathparts;
-	std::map<std::string, std::string> params;
+	Url(const string& url);
+	
+	string text;
+	UrlSlice pathparts[URL_MAX_PARTS];
+	unsigned nparts;
+	UrlSlice query;
+	
+	/// Points into text, and is not NUL-terminated
+	const char* ptr(const UrlSlice& s) const { return text.data() + s.start; }
+	
+	bool equals(const UrlSlice& s, const char* m) const {
+		return strlen(m) == s.len && memcmp(ptr(s), m, s.len) == 0;
+	}
+	
+	/// Find a query parameter's value. Returns false if it isn't present.
+	bool findParam(const char* key, UrlSlice& value) const;
 };
 
 struct UrlPath{
@@ -42,19 +78,43 @@ struct UrlPath{
 		return UrlPath(url, level+1);
 	}
 	
-	const string& get(){
-		return url.pathparts.at(level);
+	const UrlSlice& slice(){
+		if (level >= url.nparts) throw std::out_of_range("URL path too short");
+		return url.pathparts[level];
+	}
+	
+	string get(){
+		const UrlSlice& s = slice();
+		return string(url.ptr(s), s.len);
 	}
 	
-	bool matches(string m){
-		return get() == m;
+	bool matches(const char* m){
+		return url.equals(slice(), m);
 	}
 	
 	bool leaf(){
-		return url.pathparts.size() <= level;
+		return url.nparts <= level;
+	}
+	
+	string param(const char* key, const char* def=""){
+		UrlSlice v;
+		if (!url.findParam(key, v)) return def;
+		return string(url.ptr(v), v.len);
+	}
+	
+	/// Compare a parameter without copying it, e.g. param_is("raw", "1")
+	bool param_is(const char* key, const char* value, bool def=false){
+		UrlSlice v;
+		if (!url.findParam(key, v)) return def;
+		return url.equals(v, value);
 	}
 	
-	string param(string key, string def=""){
-		return map_get(url.params, key, def);
+	template <class T>
+	T param_num(const char* key, const T def){
+		UrlSlice v;
+		if (!url.findParam(key, v)) return def;
+		T n;
+		parse_num(url.ptr(v), v.len, n);
+		return n;
 	}
 };
@@ -11,6 +11,7 @@
 #include <vector>
 #include <map>
 #include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "dataserver.hpp"
 #include "cee/cee.hpp"
@@ -20,6 +21,10 @@ using namespace std;
 
 map <libusb_device *, device_ptr> active_libusb_devices;
 
+/// Devices being initialized on a probe thread. True if the device was
+/// unplugged before initialization finished. Main thread only.
+map <libusb_device *, bool> probing_libusb_devices;
+
 boost::thread* usb_thread;
 
 #define NONOLITH_VID 0x59e3
@@ -55,6 +60,30 @@ void usb_fini(){
 	libusb_exit(NULL);
 }
 
+void deviceReady(libusb_device *dev, device_ptr newDevice, double initTime);
+
+/// Runs on its own thread, as device constructors make a series of blocking
+/// control transfers. The device is published by deviceReady.
+void deviceProbe(libusb_device *dev, libusb_device_descriptor desc){
+	using namespace boost::posix_time;
+	ptime before = microsec_clock::universal_time();
+	
+	device_ptr newDevice;
+	
+	try{
+		if (desc.idProduct == CEE_PID){
+			newDevice = device_ptr(new CEE_device(dev, desc));
+		}else if (desc.idProduct == BOOTLOADER_PID || desc.idProduct == 0xb003){
+			newDevice = device_ptr(new Bootloader_device(dev, desc));
+		}
+	}catch(std::exception& e){
+		cerr << "Error initializing new device. Ignoring." << std::endl;
+	}
+	
+	double initTime = (microsec_clock::universal_time() - before).total_microseconds() / 1000.0;
+	io.post(boost::bind(deviceReady, dev, newDevice, initTime));
+}
+
 void deviceAdded(libusb_device *dev){
 	libusb_device_descriptor desc;
 	int r = libusb_get_device_descriptor(dev, &desc);
@@ -64,37 +93,49 @@ void deviceAdded(libusb_device *dev){
 		return;
 	}
 	
-	device_ptr newDevice;
-	
-	try{
-		if (desc.idVendor == NONOLITH_VID || desc.idVendor == 0x9999){
-			if (desc.idProduct == CEE_PID){
-				newDevice = device_ptr(new CEE_device(dev, desc));
-			}else if (desc.idProduct == BOOTLOADER_PID || desc.idProduct == 0xb003){
-				newDevice = device_ptr(new Bootloader_device(dev, desc));
-			}
-		}
-	}catch(std::exception e){
-		cerr << "Error initializing new device. Ignoring." << std::endl;
+	if ((desc.idVendor != NONOLITH_VID && desc.idVendor != 0x9999)
+		|| probing_libusb_devices.count(dev)){
+		libusb_unref_device(dev);
+		return;
 	}
 	
-	if (newDevice){
-		devices.insert(newDevice);
+	// The reference is held until deviceReady
+	probing_libusb_devices[dev] = false;
+	boost::thread(boost::bind(deviceProbe, dev, desc));
+}
+
+void deviceReady(libusb_device *dev, device_ptr newDevice, double initTime){
+	bool removed = probing_libusb_devices[dev];
+	probing_libusb_devices.erase(dev);
+	
+	if (newDevice && removed){
+		cerr << "Device removed during initialization" << endl;
+		newDevice->onDisconnect();
+	}else if (newDevice){
+		cerr << "    Initialized in " << initTime << " ms" << endl;
+		newDevice->initTime = initTime;
+		addDevice(newDevice);
 		active_libusb_devices.insert(pair<libusb_device *, device_ptr>(dev, newDevice));
-		device_list_changed.notify();
+		device_list_changed.post();
 	}
 	
 	libusb_unref_device(dev);
 }
 
 void deviceRemoved(libusb_device *dev){
+	map <libusb_device *, bool>::iterator p = probing_libusb_devices.find(dev);
+	if (p != probing_libusb_devices.end()){
+		p->second = true;
+		return;
+	}
+	
 	map <libusb_device *, device_ptr>::iterator it = active_libusb_devices.find(dev);
 	if (it == active_libusb_devices.end()) return;
 	cerr << "Device removed" <<std::endl;
 	device_ptr ds_dev = it->second;
-	devices.erase(ds_dev);
+	removeDevice(ds_dev);
 	active_libusb_devices.erase(it);
-	device_list_changed.notify();
+	device_list_changed.post();
 	ds_dev->onDisconnect();
 }
 
@@ -7,6 +7,8 @@
 //   Kevin Mehall <km@kevinmehall.net>
 
 #include <iostream>
+#include <deque>
+#include <sstream>
 #include <boost/foreach.hpp>
 
 #include "websocketpp.hpp"
@@ -14,9 +16,20 @@
 
 #include "dataserver.hpp"
 #include "json.hpp"
+#include "metrics.hpp"
+#include "streaming_device/device_group.hpp"
+
+/// Counters shared with the sends queued on the main thread, which may run
+/// after the connection is gone
+struct WebsocketClientMetrics{
+	MetricCounter bytesSent;
+	MetricCounter messagesSent;
+	MetricCounter queued;
+	MetricHistogram encodeTime;
+};
 
 struct WebsocketClientConn: public ClientConn{
-	WebsocketClientConn(websocketpp::session_ptr c): client(c){
+	WebsocketClientConn(websocketpp::session_ptr c): client(c), metrics(new WebsocketClientMetrics()){
 		l_device_list_changed.subscribe(
 			device_list_changed,
 			boost::bind(&WebsocketClientConn::on_device_list_changed, this)
@@ -33,32 +46,105 @@ struct WebsocketClientConn: public ClientConn{
 	}
 	
 	void sendJSON(JSONNode &n){
-		string jc = (string) n.write();
-		if (debugFlag){
-			std::cout << "TXD: " << jc <<std::endl;
+		sendJSON(n, 0, boost::shared_ptr<MetricHistogram>());
+	}
+	
+	void sendJSON(JSONNode &n, uint64_t stamp, boost::shared_ptr<MetricHistogram> age){
+		uint64_t start = monotonicMicros();
+		string jc = n.write();
+		metrics->encodeTime.observeSince(start);
+		sendString(jc, stamp, age);
+	}
+	
+	void sendString(const string& jc, uint64_t stamp=0, boost::shared_ptr<MetricHistogram> age=boost::shared_ptr<MetricHistogram>()){
+		logEvent(LOGLEVEL_DEBUG, LOGCAT_CLIENT, "TXD: %s", jc.c_str());
+		// May be called from a device's ingest thread, but the session must
+		// only be used from the main thread.
+		metrics->queued.add();
+		io.post(boost::bind(&WebsocketClientConn::send, client, jc, metrics, stamp, age));
+	}
+	
+	/// The age histogram is shared so it outlives a listener cancelled while
+	/// its last message is queued.
+	static void send(websocketpp::session_ptr client, const string& msg, boost::shared_ptr<WebsocketClientMetrics> metrics,
+			uint64_t stamp, boost::shared_ptr<MetricHistogram> age){
+		__sync_fetch_and_sub(&metrics->queued.value, 1);
+		if (stamp) age->observeSince(stamp);
+		metrics->messagesSent.add();
+		metrics->bytesSent.add(msg.size());
+		try{
+			client->send(msg);
+		}catch(std::exception &e){
+			logEvent(LOGLEVEL_ERROR, LOGCAT_CLIENT, "WS send error: %s", e.what());
 		}
-		client->send(jc);
 	}
 
 	void on_device_list_changed(){
-		JSONNode n(JSON_NODE);
-		JSONNode devices = jsonDevicesArray();
-		devices.set_name("devices");
-
-		n.push_back(JSONNode("_action", "devices"));
-		n.push_back(devices);
-
-		sendJSON(n);
+		sendString(devicesMessage());
+	}
+	
+	/// The devices message, serialized once per change for all clients
+	static const string& devicesMessage(){
+		static string message;
+		static unsigned generation = 0;
+		
+		if (message.empty() || generation != device_list_changed.generation){
+			JSONArenaScope arena;
+			JSONNode n(JSON_NODE);
+			JSONNode devices = jsonDevicesArray();
+			devices.set_name("devices");
+	
+			n.push_back(JSONNode("_action", "devices"));
+			n.push_back(devices);
+			
+			message = n.write();
+			generation = device_list_changed.generation;
+		}
+		return message;
 	}
 	
 	void on_message(const std::string &msg){
-		if (debugFlag){
-			std::cout << "RXD: " << msg << std::endl;
+		logEvent(LOGLEVEL_DEBUG, LOGCAT_CLIENT, "RXD: %s", msg.c_str());
+		
+		if (!pending.empty() || msg.size() > INCREMENTAL_PARSE_SIZE){
+			pending.push_back(PendingMessage(msg, false));
+			if (pending.size() == 1) processPending();
+			return;
 		}
-
+		
+		handleMessage(msg, useView(msg) && view.parse(msg));
+	}
+	
+	/// Only tokenize with the view if the device's fast path takes the
+	/// command, so other messages aren't tokenized twice
+	bool useView(const std::string& msg){
+		string cmd;
+		return device && jsonPeekString(msg, "_cmd", cmd) && device->handlesMessageView(cmd);
+	}
+	
+	void on_message(const std::vector<unsigned char> &data){
+		if (!pending.empty()){
+			pending.push_back(PendingMessage(string(data.begin(), data.end()), true));
+			return;
+		}
+		
+		handleBinaryMessage(data);
+	}
+	
+	/// Dispatch a text message. If `parsed`, view holds the message.
+	void handleMessage(const std::string &msg, bool parsed){
 		int id=0;
 
 		try{
+			if (device && parsed){
+				JSONViewNode v = view.root();
+				if (v.type() == JSON_NODE){
+					string cmd = jsonStringProp(v, "_cmd", "");
+					id = jsonIntProp(v, "id", 0);
+					if (device->processMessageView(*this, cmd, v)) return;
+				}
+			}
+			
 			JSONNode n = libjson::parse(msg);
 			string cmd = n.at("_cmd").as_string();
 			id = jsonIntProp(n, "id", 0); // Collect the id to use in error message
@@ -69,21 +155,23 @@ struct WebsocketClientConn: public ClientConn{
 				if (dev){
 					selectDevice(dev);
 				}else{
-					std::cerr << "Error selecting device " << id << std::endl;
+					logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "Error selecting device %s", id.c_str());
 				}
 				return;
 			}
 			
+			if (group.processMessage(*this, cmd, n)) return;
+			
 			if (!device){
-				std::cerr<<"selectDevice before using other WS calls"<<std::endl;
+				logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "selectDevice before using other WS calls");
 				return;
 			}
 			
 			if (device->processMessage(*this, cmd, n)) return;
 			
-			std::cerr << "Unknown command " << cmd << std::endl;
+			logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "Unknown command %s", cmd.c_str());
 		}catch(std::exception &e){ // TODO: more helpful error message by catching different types
-			std::cerr << "WS JSON error:" << e.what() << std::endl;
+			logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "WS JSON error: %s", e.what());
 
 			JSONNode j_error = JSONNode();
 			j_error.push_back(JSONNode("_action", "error"));
@@ -95,16 +183,116 @@ struct WebsocketClientConn: public ClientConn{
 		}		
 	}
 	
-	void on_message(const std::vector<unsigned char> &data){
+	void handleBinaryMessage(const std::vector<unsigned char> &data){
+		try{
+			if (!device){
+				logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "selectDevice before using other WS calls");
+				return;
+			}
+			
+			if (device->processBinaryMessage(*this, data)) return;
+			
+			logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "Unhandled binary message");
+		}catch(std::exception &e){
+			logEvent(LOGLEVEL_WARN, LOGCAT_CLIENT, "WS binary error: %s", e.what());
+
+			JSONNode j_error = JSONNode();
+			j_error.push_back(JSONNode("_action", "error"));
+			j_error.push_back(JSONNode("error", e.what()));
+			sendJSON(j_error);
+		}
+	}
 	
+	/// Work through the queue in order. Large messages are tokenized a slice
+	/// at a time, yielding to the io_service between slices so that streaming
+	/// data keeps flowing while a big waveform is parsed.
+	void processPending(){
+		while (!pending.empty()){
+			PendingMessage& m = pending.front();
+			
+			if (m.binary){
+				handleBinaryMessage(std::vector<unsigned char>(m.data.begin(), m.data.end()));
+			}else if (m.data.size() <= INCREMENTAL_PARSE_SIZE){
+				handleMessage(m.data, useView(m.data) && view.parse(m.data));
+			}else if (!m.started && !useView(m.data)){
+				handleMessage(m.data, false);
+			}else{
+				if (!m.started){
+					view.begin(m.data);
+					m.started = true;
+				}
+				
+				JSONView::Status status = view.step(PARSE_SLICE_TOKENS);
+				if (status == JSONView::MORE){
+					io.post(boost::bind(&WebsocketClientConn::resumePending, client));
+					return;
+				}
+				
+				handleMessage(m.data, status == JSONView::DONE);
+				view.release();
+			}
+			
+			pending.pop_front();
+		}
 	}
 	
+	static void resumePending(websocketpp::session_ptr client);
+	
+	/// Messages larger than this are parsed incrementally
+	static const unsigned INCREMENTAL_PARSE_SIZE = 64*1024;
+	
+	/// Tokens parsed per io_service turn
+	static const unsigned PARSE_SLICE_TOKENS = 8192;
+	
+	struct PendingMessage{
+		PendingMessage(const string& d, bool b): data(d), binary(b), started(false){}
+		string data;
+		bool binary;
+		bool started;
+	};
+	
+	/// Messages waiting behind one that is being parsed incrementally
+	std::deque<PendingMessage> pending;
+	
 	websocketpp::session_ptr client;
+	boost::shared_ptr<WebsocketClientMetrics> metrics;
+	
 	EventListener l_device_list_changed;
+	DeviceGroup group;
+	
+	/// Reused between messages to keep its buffers
+	JSONView view;
 };
 
 std::map<websocketpp::session_ptr, WebsocketClientConn*> connections;
 
+/// The connection may have closed while the parse was queued.
+void WebsocketClientConn::resumePending(websocketpp::session_ptr client){
+	std::map<websocketpp::session_ptr, WebsocketClientConn*>::iterator it = connections.find(client);
+	if (it != connections.end()) it->second->processPending();
+}
+
+void websocketMetrics(MetricsWriter& m){
+	m.gauge("connect_websocket_clients", "Connected websocket clients", "", connections.size());
+	
+	std::map<websocketpp::session_ptr, WebsocketClientConn*>::iterator it;
+	for (it=connections.begin(); it!=connections.end(); it++){
+		WebsocketClientConn* c = it->second;
+		std::ostringstream id;
+		id << c->id;
+		string labels = metricLabel("client", id.str());
+		
+		m.counter("connect_client_sent_bytes_total", "Bytes queued to a websocket client",
+			labels, c->metrics->bytesSent.value);
+		m.counter("connect_client_sent_messages_total", "Messages queued to a websocket client",
+			labels, c->metrics->messagesSent.value);
+		m.gauge("connect_client_queue_depth", "Messages posted to the main thread but not yet handed to the socket",
+			labels, c->metrics->queued.value);
+		m.histogram("connect_client_json_encode_seconds", "Time to serialize a JSON message",
+			labels, c->metrics->encodeTime);
+	}
+}
+
 void data_server_handler::on_open(websocketpp::session_ptr client){
 	connections.insert(std::pair<websocketpp::session_ptr, WebsocketClientConn*>(client, new WebsocketClientConn(client)));
 }